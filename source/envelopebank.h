@@ -0,0 +1,185 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstdint>
+#include <emmintrin.h>
+
+/*
+ADSR envelopes for all the voices of a synth, advanced together once per control block with
+SSE, 4 envelopes at a time. The envelope states are stored as arrays per state variable and the
+stage transitions are done with masks, so the envelopes in different stages don't need branches.
+Groups of 4 envelopes that are all idle are skipped.
+
+The parameters and the curves are like those of the sst ADSREnvelope with the shapes the synths
+use : the times are normalized 0..1 over about 4 ms to 10 seconds, the attack is linear and the
+decay and release are quadratic. The output is interpolated linearly over the control block.
+
+The envelopes of a synth must be advanced at the same sample positions, so the synth renders
+its voices in sections that don't cross the control block boundaries.
+*/
+template <int BlockSize, int MaxLanes> class ADSREnvelopeBank
+{
+  public:
+    static_assert(MaxLanes % 4 == 0 && MaxLanes <= 64);
+    static constexpr int numlanes = MaxLanes;
+    enum Stage
+    {
+        s_attack,
+        s_decay,
+        s_release,
+        s_eoc
+    };
+    ADSREnvelopeBank()
+    {
+        m_levels.fill(0.0f);
+        m_prev_levels.fill(0.0f);
+        m_stages.fill(s_eoc);
+        m_gates.fill(0);
+        m_sustains.fill(1.0f);
+        m_attack_rates.fill(1.0f);
+        m_decay_rates.fill(1.0f);
+        m_release_rates.fill(1.0f);
+        m_params.fill({-1.0f, -1.0f, -1.0f, -1.0f});
+    }
+    void setSampleRate(double sr)
+    {
+        m_samplerate = sr;
+        // forces the rates to be recalculated
+        m_params.fill({-1.0f, -1.0f, -1.0f, -1.0f});
+    }
+    // ends all the envelopes at once, for when the voices are reallocated
+    void reset()
+    {
+        m_active = 0;
+        m_just_finished = 0;
+        m_levels.fill(0.0f);
+        m_prev_levels.fill(0.0f);
+        m_stages.fill(s_eoc);
+        m_gates.fill(0);
+    }
+    // only recalculates the rates when something changed, so can be called often
+    void setParameters(int lane, float a, float d, float s, float r)
+    {
+        auto &p = m_params[lane];
+        if (a == p[0] && d == p[1] && s == p[2] && r == p[3])
+            return;
+        p = {a, d, s, r};
+        m_attack_rates[lane] = rateFromTime(a);
+        m_decay_rates[lane] = rateFromTime(d);
+        m_sustains[lane] = std::clamp(s, 0.0f, 1.0f);
+        m_release_rates[lane] = rateFromTime(r);
+    }
+    // starts the envelope from zero with the gate on
+    void attack(int lane)
+    {
+        m_levels[lane] = 0.0f;
+        m_prev_levels[lane] = 0.0f;
+        m_stages[lane] = s_attack;
+        m_gates[lane] = -1;
+        m_active |= uint64_t(1) << lane;
+    }
+    void setGate(int lane, bool gate) { m_gates[lane] = gate ? -1 : 0; }
+    // advances the envelopes by one control block. returns the lanes whose envelopes ended
+    // during the block as a bitmask
+    uint64_t process()
+    {
+        uint64_t finished = 0;
+        // the lanes that ended in the previous block are still ramping down to zero, so they are
+        // processed once more to complete the ramp
+        const uint64_t lanes = m_active | m_just_finished;
+        const __m128 zero = _mm_setzero_ps();
+        const __m128 one = _mm_set1_ps(1.0f);
+        for (int i = 0; i < MaxLanes; i += 4)
+        {
+            if (((lanes >> i) & 0xf) == 0)
+                continue;
+            const __m128 level = _mm_load_ps(&m_levels[i]);
+            _mm_store_ps(&m_prev_levels[i], level);
+            const __m128i stage = _mm_load_si128((const __m128i *)&m_stages[i]);
+            const __m128i gate = _mm_load_si128((const __m128i *)&m_gates[i]);
+            // the gate going off releases from any stage
+            const __m128i releasing = _mm_or_si128(
+                _mm_cmpeq_epi32(stage, _mm_set1_epi32(s_release)),
+                _mm_andnot_si128(gate, _mm_cmplt_epi32(stage, _mm_set1_epi32(s_release))));
+            const __m128i attacking =
+                _mm_and_si128(gate, _mm_cmpeq_epi32(stage, _mm_set1_epi32(s_attack)));
+            const __m128i decaying =
+                _mm_and_si128(gate, _mm_cmpeq_epi32(stage, _mm_set1_epi32(s_decay)));
+
+            __m128 att = _mm_add_ps(level, _mm_load_ps(&m_attack_rates[i]));
+            const __m128 attackdone = _mm_cmpge_ps(att, one);
+            att = _mm_min_ps(att, one);
+
+            // the decay and release move linearly in the square root of the level
+            const __m128 root = _mm_sqrt_ps(level);
+            const __m128 susroot = _mm_sqrt_ps(_mm_load_ps(&m_sustains[i]));
+            const __m128 decrate = _mm_load_ps(&m_decay_rates[i]);
+            __m128 dec = _mm_max_ps(_mm_sub_ps(root, decrate), susroot);
+            const __m128 below = _mm_cmplt_ps(root, susroot);
+            dec = _mm_or_ps(_mm_and_ps(below, _mm_min_ps(_mm_add_ps(root, decrate), susroot)),
+                            _mm_andnot_ps(below, dec));
+            dec = _mm_mul_ps(dec, dec);
+
+            __m128 rel = _mm_sub_ps(root, _mm_load_ps(&m_release_rates[i]));
+            const __m128 releasedone = _mm_cmple_ps(rel, zero);
+            rel = _mm_max_ps(rel, zero);
+            rel = _mm_mul_ps(rel, rel);
+
+            const __m128 attmask = _mm_castsi128_ps(attacking);
+            const __m128 decmask = _mm_castsi128_ps(decaying);
+            const __m128 relmask = _mm_castsi128_ps(releasing);
+            __m128 newlevel = _mm_and_ps(attmask, att);
+            newlevel = _mm_or_ps(newlevel, _mm_and_ps(decmask, dec));
+            newlevel = _mm_or_ps(newlevel, _mm_and_ps(relmask, rel));
+            _mm_store_ps(&m_levels[i], newlevel);
+
+            const __m128i toDecay = _mm_and_si128(attacking, _mm_castps_si128(attackdone));
+            const __m128i toEoc = _mm_and_si128(releasing, _mm_castps_si128(releasedone));
+            __m128i newstage = _mm_or_si128(
+                _mm_andnot_si128(releasing, stage),
+                _mm_and_si128(releasing, _mm_set1_epi32(s_release)));
+            newstage = _mm_or_si128(_mm_andnot_si128(toDecay, newstage),
+                                    _mm_and_si128(toDecay, _mm_set1_epi32(s_decay)));
+            newstage = _mm_or_si128(_mm_andnot_si128(toEoc, newstage),
+                                    _mm_and_si128(toEoc, _mm_set1_epi32(s_eoc)));
+            _mm_store_si128((__m128i *)&m_stages[i], newstage);
+            finished |= uint64_t(_mm_movemask_ps(_mm_castsi128_ps(toEoc))) << i;
+        }
+        m_active &= ~finished;
+        m_just_finished = finished;
+        return finished;
+    }
+    // the output at a position within the current control block
+    float getOutput(int lane, int blockpos) const
+    {
+        float prev = m_prev_levels[lane];
+        return prev + (m_levels[lane] - prev) * ((blockpos + 1) * (1.0f / BlockSize));
+    }
+    // the level at the end of the current control block
+    float getLevel(int lane) const { return m_levels[lane]; }
+    bool isActive(int lane) const { return (m_active >> lane) & 1; }
+
+  private:
+    float rateFromTime(float x) const
+    {
+        constexpr float mintime = -8.0f;
+        constexpr float maxtime = 3.32192809f;
+        float seconds = std::exp2(mintime + std::clamp(x, 0.0f, 1.0f) * (maxtime - mintime));
+        return BlockSize / (m_samplerate * seconds);
+    }
+    double m_samplerate = 44100.0;
+    uint64_t m_active = 0;
+    uint64_t m_just_finished = 0;
+    alignas(16) std::array<float, MaxLanes> m_levels;
+    alignas(16) std::array<float, MaxLanes> m_prev_levels;
+    alignas(16) std::array<int32_t, MaxLanes> m_stages;
+    // -1 for gate on, 0 for off, so these can be used as masks directly
+    alignas(16) std::array<int32_t, MaxLanes> m_gates;
+    alignas(16) std::array<float, MaxLanes> m_sustains;
+    alignas(16) std::array<float, MaxLanes> m_attack_rates;
+    alignas(16) std::array<float, MaxLanes> m_decay_rates;
+    alignas(16) std::array<float, MaxLanes> m_release_rates;
+    std::array<std::array<float, 4>, MaxLanes> m_params;
+};
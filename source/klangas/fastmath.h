@@ -0,0 +1,64 @@
+#pragma once
+
+#include <algorithm>
+#include <bit>
+#include <cmath>
+#include <cstdint>
+#include <xmmintrin.h>
+
+namespace xenakios
+{
+/*
+Fast 2^x for the pitch to frequency conversions. The argument is split into an integer part
+that goes directly into the float exponent bits and a fractional part in the range -0.5..0.5
+for which 2^x is evaluated with a polynomial. Relative error is around 1e-7, so well below
+anything audible when converting pitches.
+*/
+inline float fastexp2(float x)
+{
+    x = std::clamp(x, -126.0f, 126.0f);
+    float xi = std::nearbyint(x);
+    float f = x - xi;
+    // Taylor series of 2^f, good enough since |f| <= 0.5
+    float p =
+        1.0f +
+        f * (0.69314718f +
+             f * (0.24022651f +
+                  f * (0.05550411f + f * (0.00961813f + f * (0.00133336f + f * 0.00015404f)))));
+    int32_t e = ((int32_t)xi + 127) << 23;
+    return p * std::bit_cast<float>(e);
+}
+
+/*
+tanh approximated with the [7/6] Padé approximant. Error is below 2e-5 for |x| < 4 and
+about 1e-4 at worst. The input is clamped to where the approximant reaches 1, so the output
+stays within -1..1.
+*/
+inline __m128 fasttanh_ps(__m128 x)
+{
+    const __m128 limit = _mm_set1_ps(4.97f);
+    x = _mm_max_ps(_mm_min_ps(x, limit), _mm_sub_ps(_mm_setzero_ps(), limit));
+    __m128 x2 = _mm_mul_ps(x, x);
+    __m128 num = _mm_add_ps(_mm_set1_ps(378.0f), x2);
+    num = _mm_add_ps(_mm_set1_ps(17325.0f), _mm_mul_ps(num, x2));
+    num = _mm_add_ps(_mm_set1_ps(135135.0f), _mm_mul_ps(num, x2));
+    num = _mm_mul_ps(num, x);
+    __m128 den = _mm_add_ps(_mm_set1_ps(3150.0f), _mm_mul_ps(_mm_set1_ps(28.0f), x2));
+    den = _mm_add_ps(_mm_set1_ps(62370.0f), _mm_mul_ps(den, x2));
+    den = _mm_add_ps(_mm_set1_ps(135135.0f), _mm_mul_ps(den, x2));
+    __m128 result = _mm_div_ps(num, den);
+    const __m128 one = _mm_set1_ps(1.0f);
+    return _mm_max_ps(_mm_min_ps(result, one), _mm_sub_ps(_mm_setzero_ps(), one));
+}
+
+// in place tanh for a whole buffer
+inline void fasttanh_block(float *data, int numsamples)
+{
+    int i = 0;
+    for (; i + 4 <= numsamples; i += 4)
+        _mm_storeu_ps(&data[i], fasttanh_ps(_mm_loadu_ps(&data[i])));
+    for (; i < numsamples; ++i)
+        data[i] = _mm_cvtss_f32(fasttanh_ps(_mm_set_ss(data[i])));
+}
+
+} // namespace xenakios
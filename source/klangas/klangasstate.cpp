@@ -0,0 +1,200 @@
+#include "klangasstate.h"
+#include <algorithm>
+#include <bit>
+#include <cstring>
+
+static_assert(std::endian::native == std::endian::little,
+              "the state is read and written directly as little endian");
+
+namespace
+{
+constexpr char statemagic[4] = {'K', 'L', 'S', 'T'};
+constexpr uint32_t stateversion = 1;
+constexpr int nummodsources = AdditiveSharedData::MOS_LAST;
+constexpr int nummodtargets = AdditiveSharedData::MOT_LAST;
+
+void writeU32(std::string &out, uint32_t v) { out.append((const char *)&v, sizeof(v)); }
+
+void writeString(std::string &out, const std::string &str)
+{
+    writeU32(out, str.size());
+    out.append(str);
+}
+
+void writeChunk(std::string &out, const char (&tag)[5], const std::string &payload)
+{
+    out.append(tag, 4);
+    writeU32(out, payload.size());
+    out.append(payload);
+}
+
+// bounds checked reading from memory, all reads fail after the first failed one
+class Reader
+{
+  public:
+    Reader(const char *data, size_t size) : m_pos(data), m_end(data + size) {}
+    bool read(void *dest, size_t n)
+    {
+        if (!m_ok || (size_t)(m_end - m_pos) < n)
+            return m_ok = false;
+        std::memcpy(dest, m_pos, n);
+        m_pos += n;
+        return true;
+    }
+    uint32_t readU32()
+    {
+        uint32_t v = 0;
+        read(&v, sizeof(v));
+        return v;
+    }
+    std::string readString()
+    {
+        uint32_t size = readU32();
+        if (!m_ok || (size_t)(m_end - m_pos) < size)
+        {
+            m_ok = false;
+            return {};
+        }
+        std::string result(m_pos, size);
+        m_pos += size;
+        return result;
+    }
+    std::string readRest()
+    {
+        std::string result(m_pos, m_end);
+        m_pos = m_end;
+        return result;
+    }
+    // a reader for the next size bytes, which are skipped in this one
+    Reader sub(size_t size)
+    {
+        if (!m_ok || (size_t)(m_end - m_pos) < size)
+        {
+            m_ok = false;
+            return Reader(m_pos, 0);
+        }
+        Reader result(m_pos, size);
+        m_pos += size;
+        return result;
+    }
+    bool ok() const { return m_ok; }
+    bool atEnd() const { return m_pos == m_end; }
+
+  private:
+    const char *m_pos = nullptr;
+    const char *m_end = nullptr;
+    bool m_ok = true;
+};
+} // namespace
+
+std::string writeKlangASState(const KlangASState &state)
+{
+    const auto &synthstate = state.synthstate;
+    std::string out;
+    out.reserve(1024 + synthstate.scl.size() + synthstate.kbm.size() +
+                synthstate.morphtable.size());
+    out.append(statemagic, 4);
+    writeU32(out, stateversion);
+
+    std::string payload;
+    writeU32(payload, state.params.size());
+    payload.append((const char *)state.params.data(), state.params.size() * sizeof(float));
+    writeChunk(out, "PARM", payload);
+
+    payload.clear();
+    writeString(payload, synthstate.scl);
+    writeString(payload, synthstate.kbm);
+    writeChunk(out, "TUNE", payload);
+
+    payload.clear();
+    writeU32(payload, nummodsources);
+    writeU32(payload, nummodtargets);
+    std::vector<float> depths = synthstate.moddepths;
+    depths.resize(nummodsources * nummodtargets, 0.0f);
+    payload.append((const char *)depths.data(), depths.size() * sizeof(float));
+    writeChunk(out, "MODM", payload);
+
+    if (!synthstate.morphtable.empty())
+        writeChunk(out, "MTAB", synthstate.morphtable);
+    return out;
+}
+
+bool readKlangASState(const char *data, size_t size, KlangASState &state, std::string &error)
+{
+    Reader reader(data, size);
+    char magic[4];
+    if (!reader.read(magic, 4) || std::memcmp(magic, statemagic, 4) != 0)
+    {
+        error = "Not a KlangAS state";
+        return false;
+    }
+    uint32_t version = reader.readU32();
+    if (!reader.ok() || version < 1 || version > stateversion)
+    {
+        error = "Unsupported KlangAS state version";
+        return false;
+    }
+    state = KlangASState();
+    while (reader.ok() && !reader.atEnd())
+    {
+        char tag[4];
+        reader.read(tag, 4);
+        uint32_t chunksize = reader.readU32();
+        Reader chunk = reader.sub(chunksize);
+        if (!reader.ok())
+            break;
+        if (std::memcmp(tag, "PARM", 4) == 0)
+        {
+            uint32_t count = chunk.readU32();
+            if (count > chunksize / sizeof(float))
+            {
+                error = "Invalid parameters in the KlangAS state";
+                return false;
+            }
+            state.params.resize(count);
+            chunk.read(state.params.data(), count * sizeof(float));
+        }
+        else if (std::memcmp(tag, "TUNE", 4) == 0)
+        {
+            state.synthstate.scl = chunk.readString();
+            state.synthstate.kbm = chunk.readString();
+        }
+        else if (std::memcmp(tag, "MODM", 4) == 0)
+        {
+            uint32_t sources = chunk.readU32();
+            uint32_t targets = chunk.readU32();
+            if (chunk.ok() && (uint64_t)sources * targets <= chunksize / sizeof(float))
+            {
+                std::vector<float> saved(sources * targets);
+                chunk.read(saved.data(), saved.size() * sizeof(float));
+                // the sources and targets are only added at the ends of the enums
+                auto &depths = state.synthstate.moddepths;
+                depths.assign(nummodsources * nummodtargets, 0.0f);
+                for (int i = 0; i < std::min<int>(sources, nummodsources); ++i)
+                    for (int j = 0; j < std::min<int>(targets, nummodtargets); ++j)
+                        depths[i * nummodtargets + j] = saved[i * targets + j];
+            }
+            else
+            {
+                error = "Invalid modulation matrix in the KlangAS state";
+                return false;
+            }
+        }
+        else if (std::memcmp(tag, "MTAB", 4) == 0)
+        {
+            state.synthstate.morphtable = chunk.readRest();
+        }
+        if (!chunk.ok())
+        {
+            error = "Invalid chunk in the KlangAS state";
+            return false;
+        }
+    }
+    if (!reader.ok())
+    {
+        error = "The KlangAS state ended unexpectedly";
+        return false;
+    }
+    error.clear();
+    return true;
+}
@@ -0,0 +1,29 @@
+#pragma once
+
+#include <cstddef>
+#include <string>
+#include <vector>
+#include "sineosc.h"
+
+/*
+Binary plugin state :
+4 bytes magic "KLST"
+uint32 format version (1)
+chunks, each with a 4 byte tag, uint32 payload size and the payload. unknown chunks are
+skipped, so that older versions can load what they know from newer states
+"PARM" : uint32 number of parameters, float32 values in parameter id order
+"TUNE" : uint32 size, Scala text, uint32 size, KBM text
+"MODM" : uint32 number of sources, uint32 number of targets, float32 depths source after source
+"MTAB" : the loaded morph table in the morph table file format
+All values are little endian.
+*/
+struct KlangASState
+{
+    std::vector<float> params;
+    AdditiveSynth::PersistentState synthstate;
+};
+
+std::string writeKlangASState(const KlangASState &state);
+// only parses, nothing is built from the data, so this is fast even with a large morph table.
+// the mod depths are returned with the current matrix dimensions
+bool readKlangASState(const char *data, size_t size, KlangASState &state, std::string &error);
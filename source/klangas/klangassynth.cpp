@@ -5,6 +5,8 @@
 #include "clap/helpers/host-proxy.hh"
 #include "clap/helpers/host-proxy.hxx"
 #include "sineosc.h"
+#include "klangasstate.h"
+#include "mtsesptuning.h"
 #include "sst/basic-blocks/params/ParamMetadata.h"
 #include "gui/choc_WebView.h"
 #include "containers/choc_SingleReaderSingleWriterFIFO.h"
@@ -132,6 +134,7 @@ struct xen_klangas : public clap::helpers::Plugin<clap::helpers::MisbehaviourHan
     CommFIFO m_to_ui_fifo;
     float sampleRate = 44100.0f;
     AdditiveSynth m_synth;
+    MTSESPKeyTuning m_mts_tuning;
 
     xen_klangas(const clap_host *host, const clap_plugin_descriptor *desc)
         : clap::helpers::Plugin<clap::helpers::MisbehaviourHandler::Terminate,
@@ -141,37 +144,374 @@ struct xen_klangas : public clap::helpers::Plugin<clap::helpers::MisbehaviourHan
         host->request_callback(host);
         m_from_ui_fifo.reset(1024);
         m_to_ui_fifo.reset(1024);
+        using PID = AdditiveSynth::ParamIDs;
+        const uint32_t modflags = CLAP_PARAM_IS_AUTOMATABLE | CLAP_PARAM_IS_MODULATABLE |
+                                  CLAP_PARAM_IS_MODULATABLE_PER_NOTE_ID;
+        const uint32_t stepflags = CLAP_PARAM_IS_AUTOMATABLE | CLAP_PARAM_IS_STEPPED;
+        // the ids are used as indices into paramValues, so these must be added in id order
         paramDescriptions.push_back(ParamDesc()
-                                        .withLinearScaleFormatting("%")
+                                        .withLinearScaleFormatting("%", 100.0)
                                         .withRange(0.0, 1.0)
                                         .withDefault(1.0)
-                                        .withFlags(CLAP_PARAM_IS_AUTOMATABLE |
-                                                   CLAP_PARAM_IS_MODULATABLE |
-                                                   CLAP_PARAM_IS_MODULATABLE_PER_NOTE_ID)
+                                        .withFlags(modflags)
                                         .withName("Filter morph")
-                                        .withID((clap_id)0));
-        paramValues.push_back(paramDescriptions.back().defaultVal);
+                                        .withID((clap_id)PID::FilterMorph));
         paramDescriptions.push_back(ParamDesc()
-                                        .withLinearScaleFormatting("%")
+                                        .withLinearScaleFormatting("%", 100.0)
                                         .withRange(0.0, 1.0)
                                         .withDefault(0.5)
-                                        .withFlags(CLAP_PARAM_IS_AUTOMATABLE |
-                                                   CLAP_PARAM_IS_MODULATABLE |
-                                                   CLAP_PARAM_IS_MODULATABLE_PER_NOTE_ID)
+                                        .withFlags(modflags)
                                         .withName("Pan")
-                                        .withID((clap_id)1));
-        paramValues.push_back(paramDescriptions.back().defaultVal);
+                                        .withID((clap_id)PID::Pan));
+        paramDescriptions.push_back(ParamDesc()
+                                        .withLinearScaleFormatting("dB")
+                                        .withRange(-48.0, 0.0)
+                                        .withDefault(-9.0)
+                                        .withFlags(modflags)
+                                        .withName("Volume")
+                                        .withID((clap_id)PID::Volume));
+        paramDescriptions.push_back(ParamDesc()
+                                        .asInt()
+                                        .withRange(2.0, AdditiveVoice::maxnumpartials)
+                                        .withDefault(32.0)
+                                        .withLinearScaleFormatting("")
+                                        .withFlags(stepflags)
+                                        .withName("Number of partials")
+                                        .withID((clap_id)PID::NumPartials));
+        paramDescriptions.push_back(ParamDesc()
+                                        .withLinearScaleFormatting("%", 100.0)
+                                        .withRange(0.0, 1.0)
+                                        .withDefault(1.0)
+                                        .withFlags(modflags)
+                                        .withName("Partials volume morph")
+                                        .withID((clap_id)PID::PartialsBalance));
+        paramDescriptions.push_back(ParamDesc()
+                                        .withLinearScaleFormatting("%", 100.0)
+                                        .withRange(0.0, 1.0)
+                                        .withDefault(0.0)
+                                        .withFlags(modflags)
+                                        .withName("Partials pan morph")
+                                        .withID((clap_id)PID::PartialsPanMorph));
+        paramDescriptions.push_back(ParamDesc()
+                                        .withUnorderedMapFormatting({{0, "Lowpass 12 dB"},
+                                                                     {1, "Lowpass 24 dB"},
+                                                                     {2, "Comb"},
+                                                                     {3, "Octave saw"},
+                                                                     {4, "Random"}},
+                                                                    true)
+                                        .withDefault(2.0)
+                                        .withFlags(stepflags)
+                                        .withName("Filter mode")
+                                        .withID((clap_id)PID::FilterMode));
+        paramDescriptions.push_back(ParamDesc()
+                                        .withLinearScaleFormatting("cents")
+                                        .withRange(600.0, 2400.0)
+                                        .withDefault(1200.0)
+                                        .withFlags(CLAP_PARAM_IS_AUTOMATABLE)
+                                        .withName("Partials pseudo octave")
+                                        .withID((clap_id)PID::PseudoOctave));
+        paramDescriptions.push_back(
+            ParamDesc()
+                .withUnorderedMapFormatting({{0, "Pseudo octave"}, {1, "EDO"}}, true)
+                .withDefault(0.0)
+                .withFlags(stepflags)
+                .withName("Partials tuning")
+                .withID((clap_id)PID::PartialTuningMode));
+        paramDescriptions.push_back(ParamDesc()
+                                        .asInt()
+                                        .withRange(1.0, 72.0)
+                                        .withDefault(12.0)
+                                        .withLinearScaleFormatting("")
+                                        .withFlags(stepflags)
+                                        .withName("Partials EDO")
+                                        .withID((clap_id)PID::PartialEDO));
+        paramDescriptions.push_back(ParamDesc()
+                                        .withUnorderedMapFormatting({{0, "Subharmonics"},
+                                                                     {1, "Random"},
+                                                                     {2, "Unison"},
+                                                                     {3, "Swap pairs"},
+                                                                     {4, "Reverse"},
+                                                                     {5, "Extend"},
+                                                                     {6, "Loaded table"}},
+                                                                    true)
+                                        .withDefault(0.0)
+                                        .withFlags(stepflags)
+                                        .withName("Frequency tweaks mode")
+                                        .withID((clap_id)PID::FreqTweaksMode));
+        paramDescriptions.push_back(ParamDesc()
+                                        .withLinearScaleFormatting("%", 100.0)
+                                        .withRange(0.0, 1.0)
+                                        .withDefault(0.0)
+                                        .withFlags(modflags)
+                                        .withName("Frequency tweaks mix")
+                                        .withID((clap_id)PID::FreqTweaksMix));
+        paramDescriptions.push_back(ParamDesc()
+                                        .withLinearScaleFormatting("dB")
+                                        .withRange(-60.0, 0.0)
+                                        .withDefault(-48.0)
+                                        .withFlags(CLAP_PARAM_IS_AUTOMATABLE)
+                                        .withName("Velocity response")
+                                        .withID((clap_id)PID::VelocityResponse));
+        const float egdefaults[2][4] = {{0.2f, 0.6f, 0.5f, 0.7f}, {0.2f, 0.2f, 0.5f, 0.2f}};
+        const char *egstagenames[4] = {"Attack", "Decay", "Sustain", "Release"};
+        for (int i = 0; i < 2; ++i)
+        {
+            for (int j = 0; j < 4; ++j)
+            {
+                paramDescriptions.push_back(
+                    ParamDesc()
+                        .withLinearScaleFormatting("%", 100.0)
+                        .withRange(0.0, 1.0)
+                        .withDefault(egdefaults[i][j])
+                        .withFlags(CLAP_PARAM_IS_AUTOMATABLE)
+                        .withName("EG " + std::to_string(i + 1) + " " + egstagenames[j])
+                        .withID((clap_id)PID::EG0Attack + i * 4 + j));
+            }
+        }
+        for (int i = 0; i < 4; ++i)
+        {
+            paramDescriptions.push_back(ParamDesc()
+                                            .withATwoToTheBFormatting(1, 1, "Hz")
+                                            .withRange(-6.0, 6.0)
+                                            .withDefault(1.0)
+                                            .withFlags(CLAP_PARAM_IS_AUTOMATABLE)
+                                            .withName("LFO " + std::to_string(i + 1) + " rate")
+                                            .withID((clap_id)PID::LFO0Rate + i));
+        }
+        for (int i = 0; i < 4; ++i)
+        {
+            paramDescriptions.push_back(ParamDesc()
+                                            .withUnorderedMapFormatting({{0, "Sine"},
+                                                                         {1, "Ramp"},
+                                                                         {2, "Triangle"},
+                                                                         {3, "Pulse"},
+                                                                         {4, "Smooth noise"},
+                                                                         {5, "S&H noise"},
+                                                                         {6, "Random walk"}},
+                                                                        true)
+                                            .withDefault(0.0)
+                                            .withFlags(stepflags)
+                                            .withName("LFO " + std::to_string(i + 1) + " shape")
+                                            .withID((clap_id)PID::LFO0Shape + i));
+        }
+        for (int i = 0; i < 4; ++i)
+        {
+            paramDescriptions.push_back(ParamDesc()
+                                            .asPercentBipolar()
+                                            .withDefault(0.0)
+                                            .withFlags(CLAP_PARAM_IS_AUTOMATABLE)
+                                            .withName("LFO " + std::to_string(i + 1) + " deform")
+                                            .withID((clap_id)PID::LFO0Deform + i));
+        }
+        paramDescriptions.push_back(ParamDesc()
+                                        .withLinearScaleFormatting("semitones")
+                                        .withRange(-24.0, 24.0)
+                                        .withDefault(0.0)
+                                        .withFlags(modflags)
+                                        .withName("Pitch")
+                                        .withID((clap_id)PID::PitchAdjust));
+        paramDescriptions.push_back(ParamDesc()
+                                        .withLinearScaleFormatting("semitones")
+                                        .withRange(0.0, 12.0)
+                                        .withDefault(1.0)
+                                        .withFlags(CLAP_PARAM_IS_AUTOMATABLE)
+                                        .withName("Pitch bend range")
+                                        .withID((clap_id)PID::PitchBendRange));
+        paramDescriptions.push_back(
+            ParamDesc()
+                .asInt()
+                .withRange(0.0, AdditiveSharedData::loaded_morph_table_preset)
+                .withDefault(1.0)
+                .withLinearScaleFormatting("")
+                .withFlags(stepflags)
+                .withName("Partials volume morph table")
+                .withID((clap_id)PID::VolumeMorphPreset));
+        paramDescriptions.push_back(ParamDesc()
+                                        .asInt()
+                                        .withRange(0.0, AdditiveSharedData::num_panpresets - 1)
+                                        .withDefault(0.0)
+                                        .withLinearScaleFormatting("")
+                                        .withFlags(stepflags)
+                                        .withName("Partials pan morph table")
+                                        .withID((clap_id)PID::PanMorphPreset));
+        paramDescriptions.push_back(
+            ParamDesc()
+                .withUnorderedMapFormatting({{0, "Normal"}, {1, "2x oversampled"}, {2, "4x oversampled"}},
+                                            true)
+                .withDefault(0.0)
+                .withFlags(stepflags)
+                .withName("Saturator quality")
+                .withID((clap_id)PID::SaturatorQuality));
+        paramDescriptions.push_back(ParamDesc()
+                                        .withLinearScaleFormatting("dB")
+                                        .withRange(-160.0, -60.0)
+                                        .withDefault(-120.0)
+                                        .withFlags(CLAP_PARAM_IS_AUTOMATABLE)
+                                        .withName("Partial culling threshold")
+                                        .withID((clap_id)PID::PartialCullThreshold));
+        paramDescriptions.push_back(ParamDesc()
+                                        .withUnorderedMapFormatting({{0, "Off"},
+                                                                     {1, "Continuous"},
+                                                                     {2, "Rounded to keys"}},
+                                                                    true)
+                                        .withDefault(1.0)
+                                        .withFlags(stepflags)
+                                        .withName("Pitch modulation quantize")
+                                        .withID((clap_id)PID::PitchModQuantize));
+        paramDescriptions.push_back(
+            ParamDesc()
+                .withUnorderedMapFormatting({{0, "Off"}, {1, "On"}}, true)
+                .withDefault(0.0)
+                .withFlags(stepflags)
+                .withName("Partial envelopes")
+                .withID((clap_id)PID::PartialEnvMode));
+        paramDescriptions.push_back(ParamDesc()
+                                        .withLinearScaleFormatting("s")
+                                        .withRange(0.001, 10.0)
+                                        .withDefault(0.001)
+                                        .withFlags(CLAP_PARAM_IS_AUTOMATABLE)
+                                        .withName("Partial envelopes attack")
+                                        .withID((clap_id)PID::PartialEnvAttack));
+        paramDescriptions.push_back(ParamDesc()
+                                        .withLinearScaleFormatting("s")
+                                        .withRange(0.001, 10.0)
+                                        .withDefault(1.0)
+                                        .withFlags(CLAP_PARAM_IS_AUTOMATABLE)
+                                        .withName("Partial envelopes decay")
+                                        .withID((clap_id)PID::PartialEnvDecay));
+        paramDescriptions.push_back(ParamDesc()
+                                        .withLinearScaleFormatting("%", 100.0)
+                                        .withRange(0.0, 1.0)
+                                        .withDefault(0.0)
+                                        .withFlags(CLAP_PARAM_IS_AUTOMATABLE)
+                                        .withName("Partial envelopes sustain")
+                                        .withID((clap_id)PID::PartialEnvSustain));
+        paramDescriptions.push_back(ParamDesc()
+                                        .withLinearScaleFormatting("s")
+                                        .withRange(0.001, 10.0)
+                                        .withDefault(0.5)
+                                        .withFlags(CLAP_PARAM_IS_AUTOMATABLE)
+                                        .withName("Partial envelopes release")
+                                        .withID((clap_id)PID::PartialEnvRelease));
+        paramDescriptions.push_back(ParamDesc()
+                                        .withLinearScaleFormatting("")
+                                        .withRange(0.0, 2.0)
+                                        .withDefault(0.5)
+                                        .withFlags(CLAP_PARAM_IS_AUTOMATABLE)
+                                        .withName("Partial envelopes decay tilt")
+                                        .withID((clap_id)PID::PartialEnvTilt));
+        paramDescriptions.push_back(ParamDesc()
+                                        .asInt()
+                                        .withRange(1.0, AdditiveVoice::maxunison)
+                                        .withDefault(1.0)
+                                        .withLinearScaleFormatting("")
+                                        .withFlags(stepflags)
+                                        .withName("Unison copies")
+                                        .withID((clap_id)PID::UnisonCount));
+        paramDescriptions.push_back(ParamDesc()
+                                        .withLinearScaleFormatting("cents")
+                                        .withRange(0.0, 100.0)
+                                        .withDefault(10.0)
+                                        .withFlags(CLAP_PARAM_IS_AUTOMATABLE)
+                                        .withName("Unison detune")
+                                        .withID((clap_id)PID::UnisonDetune));
+        paramDescriptions.push_back(ParamDesc()
+                                        .withLinearScaleFormatting("%", 100.0)
+                                        .withRange(0.0, 1.0)
+                                        .withDefault(0.5)
+                                        .withFlags(CLAP_PARAM_IS_AUTOMATABLE)
+                                        .withName("Unison stereo spread")
+                                        .withID((clap_id)PID::UnisonSpread));
+        paramDescriptions.push_back(ParamDesc()
+                                        .withLinearScaleFormatting("%", 100.0)
+                                        .withRange(0.0, 1.0)
+                                        .withDefault(0.0)
+                                        .withFlags(CLAP_PARAM_IS_AUTOMATABLE)
+                                        .withName("Partial noise bandwidth")
+                                        .withID((clap_id)PID::NoiseBandwidth));
+        paramDescriptions.push_back(ParamDesc()
+                                        .asPercentBipolar()
+                                        .withRange(-1.0, 1.0)
+                                        .withDefault(0.0)
+                                        .withFlags(CLAP_PARAM_IS_AUTOMATABLE)
+                                        .withName("Partial noise bandwidth tilt")
+                                        .withID((clap_id)PID::NoiseBandwidthTilt));
+        paramDescriptions.push_back(ParamDesc()
+                                        .withLinearScaleFormatting("Hz")
+                                        .withRange(20.0, 4000.0)
+                                        .withDefault(500.0)
+                                        .withFlags(CLAP_PARAM_IS_AUTOMATABLE)
+                                        .withName("Partial noise bandwidth filter")
+                                        .withID((clap_id)PID::NoiseFilterCutoff));
+        paramDescriptions.push_back(ParamDesc()
+                                        .withLinearScaleFormatting("%", 100.0)
+                                        .withRange(0.0, 1.0)
+                                        .withDefault(0.0)
+                                        .withFlags(CLAP_PARAM_IS_AUTOMATABLE)
+                                        .withName("Burst envelope amount")
+                                        .withID((clap_id)PID::BurstMix));
+        paramDescriptions.push_back(ParamDesc()
+                                        .withLinearScaleFormatting("s")
+                                        .withRange(0.05, 8.0)
+                                        .withDefault(1.0)
+                                        .withFlags(CLAP_PARAM_IS_AUTOMATABLE)
+                                        .withName("Burst duration")
+                                        .withID((clap_id)PID::BurstDuration));
+        paramDescriptions.push_back(ParamDesc()
+                                        .asInt()
+                                        .withRange(1.0, BurstGenerator::maxbursts)
+                                        .withDefault(4.0)
+                                        .withLinearScaleFormatting("")
+                                        .withFlags(stepflags)
+                                        .withName("Burst count")
+                                        .withID((clap_id)PID::BurstCount));
+        paramDescriptions.push_back(ParamDesc()
+                                        .withLinearScaleFormatting("%", 100.0)
+                                        .withRange(0.0, 1.0)
+                                        .withDefault(1.0)
+                                        .withFlags(CLAP_PARAM_IS_AUTOMATABLE)
+                                        .withName("Burst probability")
+                                        .withID((clap_id)PID::BurstProbability));
+        paramDescriptions.push_back(ParamDesc()
+                                        .withLinearScaleFormatting("%", 100.0)
+                                        .withRange(0.0, 1.0)
+                                        .withDefault(0.5)
+                                        .withFlags(CLAP_PARAM_IS_AUTOMATABLE)
+                                        .withName("Burst distribution")
+                                        .withID((clap_id)PID::BurstDistribution));
+        paramDescriptions.push_back(ParamDesc()
+                                        .withLinearScaleFormatting("dB")
+                                        .withRange(-160.0, -60.0)
+                                        .withDefault(-96.0)
+                                        .withFlags(CLAP_PARAM_IS_AUTOMATABLE)
+                                        .withName("Released voice silence threshold")
+                                        .withID((clap_id)PID::VoiceSilenceThreshold));
+        for (auto &pd : paramDescriptions)
+        {
+            assert(pd.id == paramValues.size());
+            paramValues.push_back(pd.defaultVal);
+        }
+        // done here and not in activate, so that it doesn't replace a tuning restored from
+        // the state
+        m_synth.setEDOParameters(1200.0, 12);
     }
     void onMainThread() noexcept override {}
     bool activate(double sampleRate_, uint32_t minFrameCount,
                   uint32_t maxFrameCount) noexcept override
     {
         m_synth.prepare(sampleRate_, maxFrameCount);
-        m_synth.m_shared_data.setVolumeMorphPreset(1);
-        m_synth.m_shared_data.setPanMorphPreset(0);
-        m_synth.setEDOParameters(1200.0, 12);
+        // the voices were just created, so they need all the current values
+        for (auto &pd : paramDescriptions)
+            m_synth.handleParameterValue(-1, -1, -1, -1, pd.id, paramValues[pd.id]);
+        m_mts_tuning.connect();
+        m_synth.setKeyTuningSource(&m_mts_tuning);
         return true;
     }
+    void deactivate() noexcept override
+    {
+        m_synth.setKeyTuningSource(nullptr);
+        m_mts_tuning.disconnect();
+    }
 
   protected:
     bool implementsParams() const noexcept override { return true; }
@@ -289,7 +629,12 @@ struct xen_klangas : public clap::helpers::Plugin<clap::helpers::MisbehaviourHan
             auto pevt = reinterpret_cast<const clap_event_param_value *>(nextEvent);
             if (pevt->param_id >= 0 && pevt->param_id < paramValues.size())
             {
-                paramValues[pevt->param_id] = pevt->value;
+                bool isglobal = pevt->note_id == -1 && pevt->key == -1 && pevt->channel == -1;
+                // only changes need to be applied to the voices
+                if (isglobal && paramValues[pevt->param_id] == (float)pevt->value)
+                    break;
+                if (isglobal)
+                    paramValues[pevt->param_id] = pevt->value;
                 m_synth.handleParameterValue(pevt->port_index, pevt->channel, pevt->key,
                                              pevt->note_id, pevt->param_id, pevt->value);
                 /*
@@ -311,8 +656,8 @@ struct xen_klangas : public clap::helpers::Plugin<clap::helpers::MisbehaviourHan
         case CLAP_EVENT_PARAM_MOD:
         {
             auto pevt = reinterpret_cast<const clap_event_param_mod *>(nextEvent);
-            // m_synth.applyParameterModulation(pevt->port_index, pevt->channel, pevt->key,
-            //                                 pevt->note_id, pevt->param_id, pevt->amount);
+            m_synth.handleParameterModulation(pevt->port_index, pevt->channel, pevt->key,
+                                              pevt->note_id, pevt->param_id, pevt->amount);
             break;
         }
         default:
@@ -375,40 +720,28 @@ struct xen_klangas : public clap::helpers::Plugin<clap::helpers::MisbehaviourHan
         {
             nextEvent = inEvents->get(inEvents, nextEventIndex);
         }
-        uint32_t chunkSize = SRProvider::BLOCK_SIZE;
+        // render up to each event, so that events are applied at their exact sample positions.
+        // the voices keep their own control rate, so the rendered spans can be of any length
         uint32_t pos = 0;
-        for (auto &v : m_synth.m_voices)
-        {
-            v.setNumPartials(32);
-            v.setADSRParameters(0, 0.2, 0.6, 0.5, 0.7);
-            v.setADSRParameters(1, 0.2, 0.2, 0.5, 0.2);
-            v.m_freq_tweaks_mode = 0;
-            v.m_freq_tweaks_mix = 0.0;
-            v.m_adsr_burst_mix = 0.0;
-            v.m_base_volume = -9.0;
-            v.m_filter_morph = paramValues[0];
-            v.m_filter_mode = 2;
-            v.setPartialsBalance(1.0);
-            v.setPartialsPanMorph(0.0);
-        }
         while (pos < frameCount)
         {
-            uint32_t adjChunkSize = std::min(chunkSize, frameCount - pos);
-            while (nextEvent && nextEvent->time < pos + adjChunkSize)
+            while (nextEvent && nextEvent->time <= pos)
             {
-                auto iev = inEvents->get(inEvents, nextEventIndex);
-                handleNextEvent(iev, false);
+                handleNextEvent(nextEvent, false);
                 nextEventIndex++;
                 if (nextEventIndex >= inEventsSize)
                     nextEvent = nullptr;
                 else
                     nextEvent = inEvents->get(inEvents, nextEventIndex);
             }
+            uint32_t endpos = frameCount;
+            if (nextEvent)
+                endpos = std::min(nextEvent->time, frameCount);
             choc::buffer::SeparateChannelLayout<float> layout(process->audio_outputs->data32, pos);
-            choc::buffer::ChannelArrayView<float> bufview(layout, {2, adjChunkSize});
+            choc::buffer::ChannelArrayView<float> bufview(layout, {2, endpos - pos});
             bufview.clear();
             m_synth.processBlock(bufview);
-            pos += adjChunkSize;
+            pos = endpos;
         }
 
         visThrottleCounter += process->frames_count;
@@ -437,64 +770,66 @@ struct xen_klangas : public clap::helpers::Plugin<clap::helpers::MisbehaviourHan
     bool implementsState() const noexcept override { return true; }
     bool stateSave(const clap_ostream *stream) noexcept override
     {
-        choc::value::Value v = choc::value::createObject("");
-        v.addMember("version", 0);
-        auto fvalues = choc::value::createEmptyArray();
-        for (int i = 0; i < paramValues.size(); ++i)
+        KlangASState state;
+        state.params = paramValues;
+        state.synthstate = m_synth.getPersistentState();
+        auto data = writeKlangASState(state);
+        size_t pos = 0;
+        while (pos < data.size())
         {
-            fvalues.addArrayElement(paramValues[i]);
+            auto written = stream->write(stream, data.data() + pos, data.size() - pos);
+            if (written <= 0)
+                return false;
+            pos += written;
         }
-        v.addMember("floatvalues", fvalues);
-        auto json = choc::json::toString(v, true);
-
-        if (json.size() > 0)
-        {
-            // DBG("volume serialized json is\n" << json);
-            if (stream->write(stream, json.data(), json.size()) != -1)
-                return true;
-        }
-        return false;
+        return true;
     }
     bool stateLoad(const clap_istream *stream) noexcept override
     {
-        return false;
-        /*
-        std::string json;
-        constexpr size_t bufsize = 4096;
-        json.reserve(bufsize);
-        unsigned char buf[bufsize];
-        memset(buf, 0, bufsize);
+        std::string data;
+        constexpr size_t chunksize = 65536;
         while (true)
         {
-            int read = stream->read(stream, buf, bufsize);
+            size_t pos = data.size();
+            data.resize(pos + chunksize);
+            auto read = stream->read(stream, data.data() + pos, chunksize);
+            if (read < 0)
+                return false;
+            data.resize(pos + read);
             if (read == 0)
                 break;
-            for (size_t i = 0; i < read; ++i)
-                json.push_back(buf[i]);
         }
-        // DBG("volume deserialized json is\n" << json);
-        if (json.size() > 0)
+        KlangASState state;
+        std::string error;
+        if (!readKlangASState(data.data(), data.size(), state, error))
+            return false;
+        // parameters missing from the state get their defaults
+        for (auto &pd : paramDescriptions)
         {
-            auto val = choc::json::parseValue(json);
-            if (val.isObject() && val.hasObjectMember("version") && val["version"].get<int>() >= 0)
+            float v = pd.defaultVal;
+            if (pd.id < state.params.size())
+                v = std::clamp(state.params[pd.id], pd.minVal, pd.maxVal);
+            if (isActive())
             {
-                // these are not thread safe!
-                // but interestingly, the SST Conduit plugin seems to be doing things
-                // similarly, where they just update the plugin parameter states directly
-                auto fvalues = val["floatvalues"];
-                for (int i = 0; i < fvalues.size(); ++i)
-                {
-                    if (i < numParams)
-                    {
-                        paramValues[i] = fvalues[i].get<float>();
-                        m_synth.applyParameter(-1, -1, -1, -1, i, paramValues[i]);
-                    }
-                }
+                // the audio thread owns the values while active. it stores and applies them
+                // and also tells the host about the changes
+                m_from_ui_fifo.push(UiMessage(CLAP_EVENT_PARAM_VALUE, pd.id, v));
+            }
+            else
+            {
+                // applied to the voices in activate
+                paramValues[pd.id] = v;
             }
-            return true;
         }
-        return false;
-        */
+        m_synth.restorePersistentStateAsync(std::move(state.synthstate));
+        if (_host.canUseParams())
+        {
+            if (isActive())
+                _host.paramsRequestFlush();
+            else
+                _host.paramsRescan(CLAP_PARAM_RESCAN_VALUES);
+        }
+        return true;
     }
     bool implementsGui() const noexcept override { return false; }
     bool guiIsApiSupported(const char *api, bool isFloating) noexcept override
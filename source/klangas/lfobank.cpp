@@ -0,0 +1,166 @@
+#include "lfobank.h"
+#include <bit>
+#include <cmath>
+#include <optional>
+#include <sse_mathfun.h>
+#include "sineosc.h"
+#include "sst/basic-blocks/modulators/SimpleLFO.h"
+
+struct LFOBank::SimpleLFOLanes
+{
+    using SimpleLFO = sst::basic_blocks::modulators::SimpleLFO<SRProvider, SRProvider::BLOCK_SIZE>;
+    std::array<std::optional<SimpleLFO>, numlanes> lfos;
+};
+
+LFOBank::LFOBank(SRProvider *provider)
+    : m_provider(provider), m_simple_lfos(std::make_unique<SimpleLFOLanes>())
+{
+    for (int i = 0; i < maxvoices; ++i)
+    {
+        m_noise_gens[i].setSeed(i);
+        resetVoice(i);
+    }
+}
+
+LFOBank::~LFOBank() {}
+
+void LFOBank::resetVoice(int voice)
+{
+    for (int i = voice * numlfos; i < (voice + 1) * numlfos; ++i)
+    {
+        m_phases[i] = 0.0f;
+        m_outputs[i] = 0.0f;
+        m_noise_state0[i] = 0.0f;
+        m_noise_state1[i] = 0.0f;
+        for (auto &h : m_noise_history)
+            h[i] = 0.0f;
+        m_held_noise[i] = 0.0f;
+        m_simple_lfos->lfos[i].emplace(m_provider);
+    }
+}
+
+static inline __m128 selectps(__m128 mask, __m128 a, __m128 b)
+{
+    return _mm_or_ps(_mm_and_ps(mask, a), _mm_andnot_ps(mask, b));
+}
+
+void LFOBank::process(uint64_t voices)
+{
+    while (voices != 0)
+    {
+        processVoice(std::countr_zero(voices));
+        voices &= voices - 1;
+    }
+}
+
+void LFOBank::processVoice(int voice)
+{
+    const VoiceParams &pars = m_params[voice];
+    const int base = voice * numlfos;
+    const __m128 one = _mm_set1_ps(1.0f);
+    const __m128 half = _mm_set1_ps(0.5f);
+    const __m128 two = _mm_set1_ps(2.0f);
+    const __m128 signmask = _mm_set1_ps(-0.0f);
+
+    alignas(16) float incs[numlfos];
+    for (int i = 0; i < numlfos; ++i)
+        incs[i] = std::exp2(pars.rates[i]) * SRProvider::BLOCK_SIZE / m_samplerate;
+    __m128 inc = _mm_load_ps(incs);
+    __m128 phase = _mm_add_ps(_mm_load_ps(&m_phases[base]), inc);
+    const __m128 turned = _mm_cmpgt_ps(phase, one);
+    phase = _mm_sub_ps(phase, _mm_and_ps(turned, one));
+    _mm_store_ps(&m_phases[base], phase);
+
+    const __m128 deform = _mm_load_ps(pars.deforms.data());
+    const __m128 a =
+        _mm_mul_ps(half, _mm_max_ps(_mm_min_ps(deform, _mm_set1_ps(3.0f)), _mm_set1_ps(-3.0f)));
+    // x - a * x^2 + a twice, keeps -1 and 1 in place
+    auto bend1 = [a](__m128 x) {
+        x = _mm_add_ps(_mm_sub_ps(x, _mm_mul_ps(a, _mm_mul_ps(x, x))), a);
+        return _mm_add_ps(_mm_sub_ps(x, _mm_mul_ps(a, _mm_mul_ps(x, x))), a);
+    };
+    // x - a * x^3 + a * x twice, the odd symmetric version for the sine
+    auto bend3 = [a](__m128 x) {
+        for (int i = 0; i < 2; ++i)
+        {
+            __m128 x3 = _mm_mul_ps(x, _mm_mul_ps(x, x));
+            x = _mm_add_ps(_mm_sub_ps(x, _mm_mul_ps(a, x3)), _mm_mul_ps(a, x));
+        }
+        return x;
+    };
+
+    // the closed form shapes
+    __m128 shapes[RANDOM_WALK];
+    shapes[SINE] = bend3(sse_mathfun_sin_ps(_mm_mul_ps(phase, _mm_set1_ps(2.0f * M_PI))));
+    shapes[RAMP] = bend1(_mm_sub_ps(_mm_mul_ps(two, phase), one));
+    shapes[DOWN_RAMP] = bend1(_mm_sub_ps(one, _mm_mul_ps(two, phase)));
+    // the triangle starts from 0 going up, like the sine
+    __m128 tphase = _mm_add_ps(phase, _mm_set1_ps(0.25f));
+    tphase = _mm_sub_ps(tphase, _mm_and_ps(_mm_cmpgt_ps(tphase, one), one));
+    __m128 fourt = _mm_mul_ps(_mm_set1_ps(4.0f), tphase);
+    shapes[TRI] = bend1(selectps(_mm_cmplt_ps(tphase, half), _mm_sub_ps(fourt, one),
+                                 _mm_sub_ps(_mm_set1_ps(3.0f), fourt)));
+    // the deform sets the pulse width
+    __m128 width = _mm_mul_ps(_mm_add_ps(deform, one), half);
+    shapes[PULSE] = selectps(_mm_cmplt_ps(phase, width), one, _mm_set1_ps(-1.0f));
+
+    // new correlated noise values for the lanes that completed a cycle, the deform sets the
+    // correlation between the successive values
+    const __m128 rnd = m_noise_gens[voice].next();
+    __m128 wf = _mm_mul_ps(deform, _mm_set1_ps(0.9f));
+    __m128 wfabs = _mm_mul_ps(_mm_andnot_ps(signmask, wf), _mm_set1_ps(0.8f));
+    wfabs = _mm_sub_ps(_mm_mul_ps(two, wfabs), _mm_mul_ps(wfabs, wfabs));
+    wf = _mm_or_ps(wfabs, _mm_and_ps(signmask, wf));
+    const __m128 oneminus = _mm_sub_ps(one, wfabs);
+    __m128 s1 = _mm_load_ps(&m_noise_state1[base]);
+    __m128 s0 = _mm_load_ps(&m_noise_state0[base]);
+    __m128 news1 = _mm_sub_ps(_mm_mul_ps(rnd, oneminus), _mm_mul_ps(wf, s1));
+    __m128 news0 = _mm_sub_ps(_mm_mul_ps(news1, oneminus), _mm_mul_ps(wf, s0));
+    __m128 noise = _mm_mul_ps(news0, _mm_div_ps(one, _mm_sqrt_ps(oneminus)));
+    _mm_store_ps(&m_noise_state1[base], selectps(turned, news1, s1));
+    _mm_store_ps(&m_noise_state0[base], selectps(turned, news0, s0));
+
+    __m128 held = selectps(turned, noise, _mm_load_ps(&m_held_noise[base]));
+    _mm_store_ps(&m_held_noise[base], held);
+    shapes[SH_NOISE] = held;
+
+    __m128 h[4];
+    for (int i = 0; i < 4; ++i)
+        h[i] = _mm_load_ps(&m_noise_history[i][base]);
+    h[3] = selectps(turned, h[2], h[3]);
+    h[2] = selectps(turned, h[1], h[2]);
+    h[1] = selectps(turned, h[0], h[1]);
+    h[0] = selectps(turned, noise, h[0]);
+    for (int i = 0; i < 4; ++i)
+        _mm_store_ps(&m_noise_history[i][base], h[i]);
+    // catmull-rom interpolation from the second oldest to the second newest value
+    {
+        __m128 t = phase;
+        __m128 c1 = _mm_mul_ps(half, _mm_sub_ps(h[1], h[3]));
+        __m128 c2 = _mm_sub_ps(_mm_add_ps(h[3], _mm_mul_ps(two, h[1])),
+                               _mm_add_ps(_mm_mul_ps(_mm_set1_ps(2.5f), h[2]),
+                                          _mm_mul_ps(half, h[0])));
+        __m128 c3 = _mm_add_ps(_mm_mul_ps(half, _mm_sub_ps(h[0], h[3])),
+                               _mm_mul_ps(_mm_set1_ps(1.5f), _mm_sub_ps(h[2], h[1])));
+        __m128 v = _mm_add_ps(_mm_mul_ps(_mm_add_ps(_mm_mul_ps(c3, t), c2), t), c1);
+        shapes[SMOOTH_NOISE] = bend1(_mm_add_ps(_mm_mul_ps(v, t), h[2]));
+    }
+
+    const __m128i shapeindices = _mm_load_si128((const __m128i *)pars.shapes.data());
+    __m128 result = _mm_setzero_ps();
+    for (int i = 0; i < RANDOM_WALK; ++i)
+    {
+        __m128 mask = _mm_castsi128_ps(_mm_cmpeq_epi32(shapeindices, _mm_set1_epi32(i)));
+        result = _mm_or_ps(result, _mm_and_ps(mask, shapes[i]));
+    }
+    _mm_store_ps(&m_outputs[base], result);
+    // the random walk lanes, like the LFOs of the voices were advanced before the bank
+    for (int i = 0; i < numlfos; ++i)
+    {
+        if (pars.shapes[i] != RANDOM_WALK)
+            continue;
+        auto &lfo = *m_simple_lfos->lfos[base + i];
+        lfo.process_block(pars.rates[i], pars.deforms[i], RANDOM_WALK, false);
+        m_outputs[base + i] = lfo.outputBlock[SRProvider::BLOCK_SIZE - 1];
+    }
+}
@@ -0,0 +1,77 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <memory>
+#include "noisebank.h"
+
+/*
+The LFOs of all the voices of a synth, stored as arrays per state variable. The 4 LFOs of a
+voice are the 4 lanes of an SSE register, so a voice's LFOs are advanced in one pass with all
+the shapes evaluated and each lane selecting its own shape with masks.
+
+The LFOs of all the active voices are advanced together once per control block, on the same
+block grid as the voice envelope banks. The voices read the outputs at the start of their own
+control blocks.
+
+The shapes and the deform behave like in the sst SimpleLFO, which this replaces. The random
+walk isn't a closed form shape of the phase, so the lanes using it still run a SimpleLFO each,
+to sound exactly like before.
+*/
+struct SRProvider;
+
+class LFOBank
+{
+  public:
+    static constexpr int numlfos = 4;
+    static constexpr int maxvoices = 64;
+    enum Shape
+    {
+        SINE,
+        RAMP,
+        DOWN_RAMP,
+        TRI,
+        PULSE,
+        SMOOTH_NOISE,
+        SH_NOISE,
+        // the last SimpleLFO shape
+        RANDOM_WALK,
+        NUM_SHAPES
+    };
+    struct VoiceParams
+    {
+        // log2 of the rate in Hz
+        alignas(16) std::array<float, numlfos> rates{};
+        alignas(16) std::array<float, numlfos> deforms{};
+        alignas(16) std::array<int32_t, numlfos> shapes{};
+    };
+    LFOBank(SRProvider *provider);
+    ~LFOBank();
+    void setSampleRate(double sr) { m_samplerate = sr; }
+    // puts the voice's LFOs back to their initial state
+    void resetVoice(int voice);
+    // the parameters used from the next process call on
+    void setVoiceParams(int voice, const VoiceParams &pars) { m_params[voice] = pars; }
+    // advances the LFOs of the voices whose bits are set by one control block
+    void process(uint64_t voices);
+    // the output at the end of the latest processed control block
+    float getOutput(int voice, int lfo) const { return m_outputs[voice * numlfos + lfo]; }
+
+  private:
+    static constexpr int numlanes = maxvoices * numlfos;
+    void processVoice(int voice);
+    double m_samplerate = 44100.0;
+    std::array<VoiceParams, maxvoices> m_params;
+    alignas(16) std::array<float, numlanes> m_phases;
+    alignas(16) std::array<float, numlanes> m_outputs;
+    // the correlated noise states and the 4 latest noise values for the smooth noise, newest
+    // first
+    alignas(16) std::array<float, numlanes> m_noise_state0;
+    alignas(16) std::array<float, numlanes> m_noise_state1;
+    alignas(16) std::array<std::array<float, numlanes>, 4> m_noise_history;
+    alignas(16) std::array<float, numlanes> m_held_noise;
+    std::array<SIMDNoiseGenerator, maxvoices> m_noise_gens;
+    SRProvider *m_provider = nullptr;
+    struct SimpleLFOLanes;
+    std::unique_ptr<SimpleLFOLanes> m_simple_lfos;
+};
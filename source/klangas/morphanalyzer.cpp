@@ -0,0 +1,325 @@
+#include "morphanalyzer.h"
+#include <algorithm>
+#include <cmath>
+#include <complex>
+#include <thread>
+#include "audio/choc_AudioFileFormat_WAV.h"
+
+namespace
+{
+
+// in place radix 2 FFT, size must be a power of 2
+class SimpleFFT
+{
+  public:
+    SimpleFFT(int size) : m_size(size), m_twiddles(size / 2)
+    {
+        for (int i = 0; i < size / 2; ++i)
+            m_twiddles[i] = std::polar(1.0f, (float)(-2.0 * M_PI * i / size));
+    }
+    void perform(std::vector<std::complex<float>> &data) const
+    {
+        for (int i = 1, j = 0; i < m_size; ++i)
+        {
+            int bit = m_size >> 1;
+            for (; j & bit; bit >>= 1)
+                j ^= bit;
+            j ^= bit;
+            if (i < j)
+                std::swap(data[i], data[j]);
+        }
+        for (int len = 2; len <= m_size; len <<= 1)
+        {
+            int twstep = m_size / len;
+            for (int i = 0; i < m_size; i += len)
+            {
+                for (int k = 0; k < len / 2; ++k)
+                {
+                    auto t = m_twiddles[k * twstep] * data[i + k + len / 2];
+                    data[i + k + len / 2] = data[i + k] - t;
+                    data[i + k] += t;
+                }
+            }
+        }
+    }
+
+  private:
+    int m_size;
+    std::vector<std::complex<float>> m_twiddles;
+};
+
+// calls func(begin, end) for contiguous segments of 0..count on numthreads threads
+template <typename F> void parallelForSegments(int count, int numthreads, F &&func)
+{
+    numthreads = std::clamp(numthreads, 1, std::max(count, 1));
+    std::vector<std::thread> threads;
+    int segsize = (count + numthreads - 1) / numthreads;
+    for (int begin = 0; begin < count; begin += segsize)
+    {
+        int end = std::min(begin + segsize, count);
+        threads.emplace_back([&func, begin, end] { func(begin, end); });
+    }
+    for (auto &t : threads)
+        t.join();
+}
+
+// linearly interpolated magnitude at a fractional bin
+float magnitudeAt(const float *mags, int numbins, float bin)
+{
+    int i = (int)bin;
+    if (i < 0 || i + 1 >= numbins)
+        return 0.0f;
+    float frac = bin - i;
+    return mags[i] + (mags[i + 1] - mags[i]) * frac;
+}
+
+// picks the fundamental with the strongest harmonic series in the average spectrum. the
+// harmonics are weighted decreasingly, so that the subharmonics of the real fundamental
+// (which also get all of its harmonics) don't win
+float estimateFundamental(const std::vector<float> &avgmags, double samplerate, int fftsize)
+{
+    int numbins = (int)avgmags.size();
+    float binhz = samplerate / fftsize;
+    float bestf0 = 0.0f;
+    float bestscore = 0.0f;
+    for (float f0 = 30.0f; f0 < 1500.0f; f0 *= std::pow(2.0f, 1.0f / 96))
+    {
+        float score = 0.0f;
+        float weight = 1.0f;
+        for (int h = 1; h <= 10; ++h)
+        {
+            float bin = h * f0 / binhz;
+            // the analysis window spreads each harmonic over a few bins, so look around
+            float m = std::max({magnitudeAt(avgmags.data(), numbins, bin - 1.0f),
+                                magnitudeAt(avgmags.data(), numbins, bin),
+                                magnitudeAt(avgmags.data(), numbins, bin + 1.0f)});
+            score += m * weight;
+            weight *= 0.8f;
+        }
+        if (score > bestscore)
+        {
+            bestscore = score;
+            bestf0 = f0;
+        }
+    }
+    return bestf0;
+}
+
+} // namespace
+
+MorphAnalysisResult analyzeToMorphTable(const float *samples, size_t numsamples,
+                                        double samplerate, const MorphAnalysisSettings &settings)
+{
+    MorphAnalysisResult result;
+    if (numsamples == 0 || samplerate <= 0.0)
+    {
+        result.error = "No audio to analyze";
+        return result;
+    }
+    int fftsize = 256;
+    while (fftsize < settings.fftsize && fftsize < 65536)
+        fftsize *= 2;
+    int hopsize = std::clamp(settings.hopsize, 1, fftsize);
+    int numbins = fftsize / 2 + 1;
+    int numthreads = settings.numthreads;
+    if (numthreads <= 0)
+        numthreads = std::max(1u, std::thread::hardware_concurrency());
+    int numstftframes = 1;
+    if (numsamples > (size_t)fftsize)
+        numstftframes = 1 + (int)((numsamples - fftsize) / hopsize);
+
+    std::vector<float> window(fftsize);
+    float windowsum = 0.0f;
+    for (int i = 0; i < fftsize; ++i)
+    {
+        window[i] = 0.5f - 0.5f * std::cos(2.0 * M_PI * i / fftsize);
+        windowsum += window[i];
+    }
+    // scales the magnitude of a sinusoid peak to its amplitude
+    const float magscaler = 2.0f / windowsum;
+
+    // magnitude spectra of all the STFT frames
+    std::vector<float> mags(numstftframes * (size_t)numbins);
+    SimpleFFT fft(fftsize);
+    parallelForSegments(numstftframes, numthreads, [&](int begin, int end) {
+        std::vector<std::complex<float>> buf(fftsize);
+        for (int i = begin; i < end; ++i)
+        {
+            size_t pos = (size_t)i * hopsize;
+            for (int j = 0; j < fftsize; ++j)
+            {
+                float s = pos + j < numsamples ? samples[pos + j] : 0.0f;
+                buf[j] = s * window[j];
+            }
+            fft.perform(buf);
+            float *dest = &mags[i * (size_t)numbins];
+            for (int j = 0; j < numbins; ++j)
+                dest[j] = std::abs(buf[j]) * magscaler;
+        }
+    });
+
+    float f0 = settings.fundamental;
+    if (f0 <= 0.0f)
+    {
+        std::vector<float> avgmags(numbins, 0.0f);
+        for (int i = 0; i < numstftframes; ++i)
+            for (int j = 0; j < numbins; ++j)
+                avgmags[j] += mags[i * (size_t)numbins + j];
+        f0 = estimateFundamental(avgmags, samplerate, fftsize);
+    }
+    if (f0 <= 0.0f)
+    {
+        result.error = "Could not find a fundamental frequency";
+        return result;
+    }
+    result.fundamental = f0;
+
+    // track the harmonic peaks in each STFT frame
+    const int numpartials = std::clamp(settings.numpartials, 1, CompactMorphTable::maxpartials);
+    const float binhz = samplerate / fftsize;
+    std::vector<float> partialamps(numstftframes * (size_t)numpartials, 0.0f);
+    std::vector<float> partialfreqs(numstftframes * (size_t)numpartials, 0.0f);
+    parallelForSegments(numstftframes, numthreads, [&](int begin, int end) {
+        for (int i = begin; i < end; ++i)
+        {
+            const float *frame = &mags[i * (size_t)numbins];
+            for (int p = 0; p < numpartials; ++p)
+            {
+                float target = (p + 1) * f0;
+                int bin0 = std::max(1, (int)((target - 0.5f * f0) / binhz));
+                int bin1 = std::min(numbins - 2, (int)((target + 0.5f * f0) / binhz));
+                if (bin0 > bin1)
+                    break; // above Nyquist
+                int peakbin = bin0;
+                for (int b = bin0 + 1; b <= bin1; ++b)
+                    if (frame[b] > frame[peakbin])
+                        peakbin = b;
+                // parabolic interpolation of the peak in the log magnitude spectrum
+                float a = std::log(frame[peakbin - 1] + 1e-9f);
+                float b = std::log(frame[peakbin] + 1e-9f);
+                float c = std::log(frame[peakbin + 1] + 1e-9f);
+                float denom = a - 2.0f * b + c;
+                float offset = denom < 0.0f ? std::clamp(0.5f * (a - c) / denom, -0.5f, 0.5f) : 0.0f;
+                partialamps[i * (size_t)numpartials + p] =
+                    std::exp(b - 0.25f * (a - c) * offset);
+                partialfreqs[i * (size_t)numpartials + p] = (peakbin + offset) * binhz;
+            }
+        }
+    });
+
+    // the STFT frames are averaged (as power) into the morph frames
+    const int numframes = std::clamp(settings.numframes, 1, CompactMorphTable::maxframes);
+    std::vector<float> framegains(numframes * (size_t)numpartials, 0.0f);
+    float maxgain = 0.0f;
+    for (int f = 0; f < numframes; ++f)
+    {
+        int s0 = (int)((int64_t)f * numstftframes / numframes);
+        int s1 = std::max(s0 + 1, (int)((int64_t)(f + 1) * numstftframes / numframes));
+        s1 = std::min(s1, numstftframes);
+        for (int p = 0; p < numpartials; ++p)
+        {
+            float power = 0.0f;
+            for (int s = s0; s < s1; ++s)
+            {
+                float amp = partialamps[s * (size_t)numpartials + p];
+                power += amp * amp;
+            }
+            float gain = std::sqrt(power / std::max(s1 - s0, 1));
+            framegains[f * (size_t)numpartials + p] = gain;
+            maxgain = std::max(maxgain, gain);
+        }
+    }
+    if (maxgain <= 0.0f)
+    {
+        result.error = "The audio is silent";
+        return result;
+    }
+    auto table = std::make_unique<CompactMorphTable>(numframes, numpartials);
+    for (int f = 0; f < numframes; ++f)
+        for (int p = 0; p < numpartials; ++p)
+            table->setGain(f, p, framegains[f * (size_t)numpartials + p] / maxgain);
+    table->updateGuardFrame();
+
+    // amplitude weighted average of the measured frequencies over the whole sound. the peak
+    // amplitudes never go quite to zero, so only the frames where the partial is within 60 dB
+    // of the loudest partial are used, otherwise the noise peaks of silent partials would
+    // produce random ratios. partials that are never that loud stay harmonic
+    const float maxamp = *std::max_element(partialamps.begin(), partialamps.end());
+    const float ampthreshold = maxamp * 0.001f;
+    std::vector<float> ratios(numpartials, 1.0f);
+    for (int p = 0; p < numpartials; ++p)
+    {
+        double weightsum = 0.0;
+        double freqsum = 0.0;
+        for (int s = 0; s < numstftframes; ++s)
+        {
+            float amp = partialamps[s * (size_t)numpartials + p];
+            if (amp < ampthreshold)
+                continue;
+            weightsum += amp;
+            freqsum += amp * partialfreqs[s * (size_t)numpartials + p];
+        }
+        if (weightsum > 0.0)
+            ratios[p] = (float)(freqsum / weightsum / ((p + 1) * f0));
+    }
+    table->setFreqRatios(std::move(ratios));
+    result.table = std::move(table);
+    return result;
+}
+
+MorphAnalysisResult analyzeFileToMorphTable(const std::filesystem::path &path,
+                                            const MorphAnalysisSettings &settings)
+{
+    MorphAnalysisResult result;
+    choc::audio::AudioFileFormatList fmtList;
+    fmtList.addFormat(std::make_unique<choc::audio::WAVAudioFileFormat<false>>());
+    auto reader = fmtList.createReader(path.string());
+    if (!reader)
+    {
+        result.error = "Could not create reader for " + path.string();
+        return result;
+    }
+    auto props = reader->getProperties();
+    if (props.numChannels == 0 || props.numFrames == 0)
+    {
+        result.error = path.string() + " has no audio";
+        return result;
+    }
+    choc::buffer::ChannelArrayBuffer<float> readbuf(
+        choc::buffer::Size(props.numChannels, props.numFrames));
+    if (!reader->readFrames(0, readbuf.getView()))
+    {
+        result.error = "Could not read " + path.string();
+        return result;
+    }
+    std::vector<float> mono(props.numFrames, 0.0f);
+    for (uint32_t ch = 0; ch < props.numChannels; ++ch)
+        for (size_t i = 0; i < mono.size(); ++i)
+            mono[i] += readbuf.getSample(ch, i) / props.numChannels;
+    result = analyzeToMorphTable(mono.data(), mono.size(), props.sampleRate, settings);
+    if (!result.error.empty())
+        result.error = path.string() + " : " + result.error;
+    return result;
+}
+
+std::vector<std::string> analyzeFilesToMorphTables(const std::vector<std::filesystem::path> &files,
+                                                   const std::filesystem::path &outputdir,
+                                                   const MorphAnalysisSettings &settings)
+{
+    std::vector<std::string> errors;
+    for (auto &f : files)
+    {
+        // each file already uses all the threads for its STFT segments
+        auto result = analyzeFileToMorphTable(f, settings);
+        if (!result.table)
+        {
+            errors.push_back(result.error);
+            continue;
+        }
+        auto outpath = outputdir / f.filename().replace_extension(".klmt");
+        std::string error;
+        if (!writeMorphTableFile(outpath, *result.table, error))
+            errors.push_back(error);
+    }
+    return errors;
+}
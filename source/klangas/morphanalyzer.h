@@ -0,0 +1,49 @@
+#pragma once
+
+#include <filesystem>
+#include <memory>
+#include <string>
+#include <vector>
+#include "morphtable.h"
+
+/*
+Turns recorded sounds into morph tables for KlangAS. The sound is analyzed with a short time
+Fourier transform and the harmonic peaks of the (given or estimated) fundamental are tracked
+over time. The time axis of the sound becomes the morph axis of the table, so morphing from 0 to
+1 goes through the spectral evolution of the sound. The measured partial frequencies, relative
+to the exact harmonics, are stored as the frequency ratios of the table.
+
+The STFT frames are analyzed in parallel, split into time segments for the worker threads.
+*/
+struct MorphAnalysisSettings
+{
+    // morph frames in the produced table
+    int numframes = 16;
+    int numpartials = 64;
+    // rounded up to a power of 2
+    int fftsize = 4096;
+    int hopsize = 512;
+    // in Hz, 0 estimates it from the sound
+    float fundamental = 0.0f;
+    // 0 uses all hardware threads
+    int numthreads = 0;
+};
+
+struct MorphAnalysisResult
+{
+    std::unique_ptr<CompactMorphTable> table;
+    // the fundamental used for the analysis
+    float fundamental = 0.0f;
+    std::string error;
+};
+
+MorphAnalysisResult analyzeToMorphTable(const float *samples, size_t numsamples,
+                                        double samplerate, const MorphAnalysisSettings &settings);
+// reads the file with choc, multichannel files are mixed to mono
+MorphAnalysisResult analyzeFileToMorphTable(const std::filesystem::path &path,
+                                            const MorphAnalysisSettings &settings);
+// analyzes the files one by one and writes the tables as .klmt files with the same names into
+// outputdir. returns the error texts of the files that failed
+std::vector<std::string> analyzeFilesToMorphTables(const std::vector<std::filesystem::path> &files,
+                                                   const std::filesystem::path &outputdir,
+                                                   const MorphAnalysisSettings &settings);
@@ -0,0 +1,59 @@
+#include <iostream>
+#include <string>
+#include <vector>
+#include "morphanalyzer.h"
+
+// batch converts audio files into KlangAS morph tables
+int main(int argc, char **argv)
+{
+    if (argc < 3)
+    {
+        std::cout << "usage : MorphAnalyzer [--frames n] [--partials n] [--fft n] [--hop n] "
+                     "[--f0 hz] outputdir file1 [file2 ...]\n";
+        return 1;
+    }
+    MorphAnalysisSettings settings;
+    std::vector<std::string> args(argv + 1, argv + argc);
+    size_t pos = 0;
+    try
+    {
+        while (pos + 1 < args.size() && args[pos].starts_with("--"))
+        {
+            const auto &opt = args[pos];
+            const auto &val = args[pos + 1];
+            if (opt == "--frames")
+                settings.numframes = std::stoi(val);
+            else if (opt == "--partials")
+                settings.numpartials = std::stoi(val);
+            else if (opt == "--fft")
+                settings.fftsize = std::stoi(val);
+            else if (opt == "--hop")
+                settings.hopsize = std::stoi(val);
+            else if (opt == "--f0")
+                settings.fundamental = std::stof(val);
+            else
+            {
+                std::cout << "unknown option " << opt << "\n";
+                return 1;
+            }
+            pos += 2;
+        }
+    }
+    catch (const std::exception &e)
+    {
+        std::cout << "invalid option value : " << e.what() << "\n";
+        return 1;
+    }
+    if (pos + 2 > args.size())
+    {
+        std::cout << "no output directory or input files given\n";
+        return 1;
+    }
+    std::filesystem::path outputdir = args[pos];
+    std::vector<std::filesystem::path> files(args.begin() + pos + 1, args.end());
+    auto errors = analyzeFilesToMorphTables(files, outputdir, settings);
+    for (auto &e : errors)
+        std::cout << e << "\n";
+    std::cout << files.size() - errors.size() << " of " << files.size() << " files converted\n";
+    return errors.empty() ? 0 : 1;
+}
@@ -0,0 +1,213 @@
+#include "morphtable.h"
+#include <algorithm>
+#include <bit>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <emmintrin.h>
+
+CompactMorphTable::CompactMorphTable(int numframes, int numpartials)
+{
+    m_numframes = std::clamp(numframes, 1, maxframes);
+    m_numpartials = std::clamp(numpartials, 1, maxpartials);
+    m_stride = (m_numpartials + 7) & ~7;
+    m_data.resize((m_numframes + 1) * m_stride, 0);
+}
+
+void CompactMorphTable::updateGuardFrame()
+{
+    std::copy(getFrameData(m_numframes - 1), getFrameData(m_numframes - 1) + m_stride,
+              getFrameData(m_numframes));
+}
+
+void CompactMorphTable::getInterpolatedGains(int frame, float frac, int numpartials,
+                                             float *gains) const
+{
+    frame = std::clamp(frame, 0, m_numframes - 1);
+    const uint16_t *f0 = getFrameData(frame);
+    const uint16_t *f1 = getFrameData(frame + 1);
+    // the padding in the stride is zeros, so can read all of it
+    int numtoread = std::min((numpartials + 3) & ~3, m_stride);
+    const __m128 scaler = _mm_set1_ps(1.0f / 65535.0f);
+    const __m128 fracv = _mm_set1_ps(frac);
+    const __m128i zero = _mm_setzero_si128();
+    for (int i = 0; i < numtoread; i += 4)
+    {
+        // 4 unsigned 16 bit values widened to 32 bit integers and converted to floats
+        __m128i i0 = _mm_unpacklo_epi16(_mm_loadl_epi64((const __m128i *)&f0[i]), zero);
+        __m128i i1 = _mm_unpacklo_epi16(_mm_loadl_epi64((const __m128i *)&f1[i]), zero);
+        __m128 g0 = _mm_mul_ps(_mm_cvtepi32_ps(i0), scaler);
+        __m128 g1 = _mm_mul_ps(_mm_cvtepi32_ps(i1), scaler);
+        _mm_storeu_ps(&gains[i], _mm_add_ps(g0, _mm_mul_ps(_mm_sub_ps(g1, g0), fracv)));
+    }
+    for (int i = numtoread; i < numpartials; ++i)
+        gains[i] = 0.0f;
+}
+
+float CompactMorphTable::getMaxGain(int frame0, int frame1, int partial) const
+{
+    if (partial >= m_numpartials)
+        return 0.0f;
+    frame0 = std::clamp(frame0, 0, m_numframes);
+    frame1 = std::clamp(frame1, 0, m_numframes);
+    uint16_t result = 0;
+    for (int i = frame0; i <= frame1; ++i)
+        result = std::max(result, m_data[i * m_stride + partial]);
+    return result * (1.0f / 65535.0f);
+}
+
+static_assert(std::endian::native == std::endian::little,
+              "morph table files are read and written directly as little endian");
+
+namespace
+{
+constexpr char morphtablemagic[4] = {'K', 'L', 'M', 'T'};
+constexpr uint32_t morphtableversion = 2;
+constexpr uint32_t morphtableformat_unorm16 = 0;
+} // namespace
+
+std::unique_ptr<CompactMorphTable> readMorphTable(std::istream &is, const std::string &name,
+                                                  std::string &error)
+{
+    char magic[4];
+    uint32_t header[4];
+    is.read(magic, 4);
+    is.read((char *)header, sizeof(header));
+    if (!is || std::memcmp(magic, morphtablemagic, 4) != 0)
+    {
+        error = name + " is not a morph table file";
+        return nullptr;
+    }
+    uint32_t version = header[0];
+    if (version < 1 || version > morphtableversion || header[3] != morphtableformat_unorm16)
+    {
+        error = name + " has an unsupported morph table version or format";
+        return nullptr;
+    }
+    uint32_t numframes = header[1];
+    uint32_t numpartials = header[2];
+    if (numframes < 1 || numframes > CompactMorphTable::maxframes || numpartials < 1 ||
+        numpartials > CompactMorphTable::maxpartials)
+    {
+        error = name + " has invalid morph table dimensions";
+        return nullptr;
+    }
+    auto table = std::make_unique<CompactMorphTable>(numframes, numpartials);
+    // the frames are read one by one straight into the padded table storage
+    for (uint32_t i = 0; i < numframes; ++i)
+    {
+        is.read((char *)table->getFrameData(i), numpartials * sizeof(uint16_t));
+        if (!is)
+        {
+            error = name + " ended unexpectedly";
+            return nullptr;
+        }
+    }
+    table->updateGuardFrame();
+    if (version >= 2)
+    {
+        uint32_t numratios = 0;
+        is.read((char *)&numratios, sizeof(numratios));
+        if (!is || (numratios != 0 && numratios != numpartials))
+        {
+            error = name + " has invalid frequency ratios";
+            return nullptr;
+        }
+        std::vector<float> ratios(numratios);
+        is.read((char *)ratios.data(), numratios * sizeof(float));
+        if (!is)
+        {
+            error = name + " ended unexpectedly";
+            return nullptr;
+        }
+        table->setFreqRatios(std::move(ratios));
+    }
+    error.clear();
+    return table;
+}
+
+bool writeMorphTable(std::ostream &os, const CompactMorphTable &table)
+{
+    uint32_t header[4] = {morphtableversion, (uint32_t)table.getNumFrames(),
+                          (uint32_t)table.getNumPartials(), morphtableformat_unorm16};
+    os.write(morphtablemagic, 4);
+    os.write((const char *)header, sizeof(header));
+    for (int i = 0; i < table.getNumFrames(); ++i)
+        os.write((const char *)table.getFrameData(i), table.getNumPartials() * sizeof(uint16_t));
+    const auto &ratios = table.getFreqRatios();
+    uint32_t numratios = (int)ratios.size() == table.getNumPartials() ? ratios.size() : 0;
+    os.write((const char *)&numratios, sizeof(numratios));
+    os.write((const char *)ratios.data(), numratios * sizeof(float));
+    return (bool)os;
+}
+
+std::unique_ptr<CompactMorphTable> readMorphTableFile(const std::filesystem::path &path,
+                                                      std::string &error)
+{
+    std::ifstream is(path, std::ios::binary);
+    if (!is)
+    {
+        error = "Could not open " + path.string();
+        return nullptr;
+    }
+    return readMorphTable(is, path.string(), error);
+}
+
+bool writeMorphTableFile(const std::filesystem::path &path, const CompactMorphTable &table,
+                         std::string &error)
+{
+    std::ofstream os(path, std::ios::binary);
+    if (!os)
+    {
+        error = "Could not open " + path.string() + " for writing";
+        return false;
+    }
+    if (!writeMorphTable(os, table))
+    {
+        error = "Error writing " + path.string();
+        return false;
+    }
+    error.clear();
+    return true;
+}
+
+void MorphTableLoader::requestLoad(std::filesystem::path path)
+{
+    post({std::move(path), {}});
+}
+
+void MorphTableLoader::requestDecode(std::string data) { post({{}, std::move(data)}); }
+
+void MorphTableLoader::post(Request request)
+{
+    {
+        std::lock_guard<std::mutex> locker(m_mutex);
+        m_request = std::move(request);
+    }
+    m_worker.post([this] { runPending(); });
+}
+
+void MorphTableLoader::runPending()
+{
+    Request request;
+    {
+        std::lock_guard<std::mutex> locker(m_mutex);
+        // already done by an earlier run
+        if (!m_request)
+            return;
+        request = std::move(*m_request);
+        m_request.reset();
+    }
+    std::string error;
+    std::unique_ptr<CompactMorphTable> table;
+    if (!request.path.empty())
+    {
+        table = readMorphTableFile(request.path, error);
+    }
+    else if (!request.data.empty())
+    {
+        std::istringstream is(request.data);
+        table = readMorphTable(is, "The saved morph table", error);
+    }
+    m_callback(std::move(table), error);
+}
@@ -0,0 +1,133 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <filesystem>
+#include <functional>
+#include <iosfwd>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <vector>
+#include "taskworker.h"
+
+/*
+Partial amplitude morph table of arbitrary size (up to maxframes x maxpartials), stored as
+unsigned normalized 16 bit gains. At the maximum size that's 512 kilobytes instead of the
+megabyte the same table would take as floats, which matters when many tables are kept around
+or streamed in from disk. 16 bits give about 96 dB of range, which is below the partial
+culling threshold anyway.
+
+The frames are stored with the partials padded to a multiple of 8 and with an extra guard frame
+at the end, so the interpolation never has to check the bounds.
+*/
+class CompactMorphTable
+{
+  public:
+    static constexpr int maxframes = 256;
+    static constexpr int maxpartials = 1024;
+    // the sizes are clamped into the supported range, all gains start at 0
+    CompactMorphTable(int numframes, int numpartials);
+    int getNumFrames() const { return m_numframes; }
+    int getNumPartials() const { return m_numpartials; }
+    void setGain(int frame, int partial, float gain)
+    {
+        gain = std::clamp(gain, 0.0f, 1.0f);
+        m_data[frame * m_stride + partial] = (uint16_t)(gain * 65535.0f + 0.5f);
+    }
+    float getGain(int frame, int partial) const
+    {
+        return m_data[frame * m_stride + partial] * (1.0f / 65535.0f);
+    }
+    // direct access to the raw gains of a frame, for the file loading
+    uint16_t *getFrameData(int frame) { return &m_data[frame * m_stride]; }
+    const uint16_t *getFrameData(int frame) const { return &m_data[frame * m_stride]; }
+    // must be called after the last frame has been changed
+    void updateGuardFrame();
+    // gains interpolated between frame and frame + 1 for the first numpartials partials,
+    // partials beyond the table size get 0. done 4 partials at a time with SSE, so gains
+    // should have space for numpartials rounded up to a multiple of 4
+    void getInterpolatedGains(int frame, float frac, int numpartials, float *gains) const;
+    // largest gain of the partial within the frame range, both ends included
+    float getMaxGain(int frame0, int frame1, int partial) const;
+    // optional frequencies of the partials relative to the harmonic series, usable as partial
+    // frequency tweak ratios. empty if the table doesn't have them
+    void setFreqRatios(std::vector<float> ratios) { m_freq_ratios = std::move(ratios); }
+    const std::vector<float> &getFreqRatios() const { return m_freq_ratios; }
+    float getFreqRatio(int partial) const
+    {
+        if (partial < (int)m_freq_ratios.size())
+            return m_freq_ratios[partial];
+        return 1.0f;
+    }
+    // set when published, so users can detect a different table
+    uint64_t getSerial() const { return m_serial; }
+
+  private:
+    friend class AdditiveSharedData;
+    uint64_t m_serial = 0;
+    int m_numframes = 0;
+    int m_numpartials = 0;
+    int m_stride = 0;
+    std::vector<uint16_t> m_data;
+    std::vector<float> m_freq_ratios;
+};
+
+/*
+Binary morph table file :
+4 bytes magic "KLMT"
+uint32 format version (2, version 1 files are also read)
+uint32 number of frames
+uint32 number of partials
+uint32 sample format (0 = unorm16)
+frames * partials uint16 gains, frame after frame
+from version 2 :
+uint32 number of frequency ratios (0 or the number of partials)
+float32 frequency ratios
+All values are little endian.
+The stream versions are for tables embedded in other data, name is used in the error messages.
+*/
+std::unique_ptr<CompactMorphTable> readMorphTable(std::istream &is, const std::string &name,
+                                                  std::string &error);
+bool writeMorphTable(std::ostream &os, const CompactMorphTable &table);
+std::unique_ptr<CompactMorphTable> readMorphTableFile(const std::filesystem::path &path,
+                                                      std::string &error);
+bool writeMorphTableFile(const std::filesystem::path &path, const CompactMorphTable &table,
+                         std::string &error);
+
+/*
+Loads morph tables on a worker thread, so that large tables don't block the thread that asks
+for them. The tables come from files, or from data in the morph table file format, as saved in
+the plugin state. If several requests are made before the worker gets to them, only the latest
+one is done. The callback is called on the worker thread with either the table or an error
+message, a request with empty data gets neither.
+*/
+class MorphTableLoader
+{
+  public:
+    using Callback =
+        std::function<void(std::unique_ptr<CompactMorphTable> table, const std::string &error)>;
+    // the worker must be stopped before the loader is destroyed
+    MorphTableLoader(TaskWorker &worker, Callback cb)
+        : m_worker(worker), m_callback(std::move(cb))
+    {
+    }
+    MorphTableLoader(const MorphTableLoader &) = delete;
+    MorphTableLoader &operator=(const MorphTableLoader &) = delete;
+    void requestLoad(std::filesystem::path path);
+    void requestDecode(std::string data);
+
+  private:
+    struct Request
+    {
+        std::filesystem::path path;
+        std::string data;
+    };
+    void post(Request request);
+    void runPending();
+    TaskWorker &m_worker;
+    Callback m_callback;
+    std::mutex m_mutex;
+    std::optional<Request> m_request;
+};
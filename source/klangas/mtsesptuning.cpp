@@ -0,0 +1,49 @@
+#include "mtsesptuning.h"
+#include <cmath>
+#include "libMTSClient.h"
+
+MTSESPKeyTuning::~MTSESPKeyTuning() { disconnect(); }
+
+void MTSESPKeyTuning::connect()
+{
+    if (!m_client)
+        m_client = MTS_RegisterClient();
+}
+
+void MTSESPKeyTuning::disconnect()
+{
+    if (m_client)
+    {
+        MTS_DeregisterClient(m_client);
+        m_client = nullptr;
+    }
+}
+
+bool MTSESPKeyTuning::pollKeyPitches(KeyPitchTable &table)
+{
+    if (!m_client || !MTS_HasMaster(m_client))
+    {
+        if (!table.active)
+            return false;
+        table.active = false;
+        // so that the table gets fully recalculated when a master appears again
+        m_key_freqs.fill(0.0);
+        return true;
+    }
+    bool changed = !table.active;
+    for (int i = 0; i < KeyPitchTable::numkeys; ++i)
+    {
+        double hz = MTS_NoteToFrequency(m_client, (char)i, -1);
+        if (hz == m_key_freqs[i] && table.active)
+            continue;
+        m_key_freqs[i] = hz;
+        table.key_pitches[i] = 12.0 * std::log2(std::max(hz, 1.0) / Tunings::MIDI_0_FREQ);
+        changed = true;
+    }
+    if (changed)
+    {
+        table.key_pitches[KeyPitchTable::numkeys] = table.key_pitches[KeyPitchTable::numkeys - 1];
+        table.active = true;
+    }
+    return changed;
+}
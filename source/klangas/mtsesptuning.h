@@ -0,0 +1,29 @@
+#pragma once
+
+#include <array>
+#include "sineosc.h"
+
+struct MTSClient;
+
+/*
+Follows the tuning of an MTS-ESP master. The key frequencies are read from the client when
+polled, but the key pitch table is only recalculated for keys whose frequency has changed, so
+while the tuning stays the same, polling is just 128 cheap frequency queries and comparisons.
+When there's no master, the table is deactivated and KlangAS uses its own tuning.
+*/
+class MTSESPKeyTuning : public KeyTuningSource
+{
+  public:
+    MTSESPKeyTuning() { m_key_freqs.fill(0.0); }
+    ~MTSESPKeyTuning() override;
+    // main thread, while the audio isn't running
+    void connect();
+    void disconnect();
+    // audio thread
+    bool pollKeyPitches(KeyPitchTable &table) override;
+
+  private:
+    MTSClient *m_client = nullptr;
+    // the frequencies the table was last calculated from
+    std::array<double, KeyPitchTable::numkeys> m_key_freqs;
+};
@@ -0,0 +1,117 @@
+#pragma once
+
+#include <array>
+#include <cmath>
+#include <cstdint>
+#include <emmintrin.h>
+
+/*
+Uniform white noise from 4 independent xorshift32 generators running in the lanes of an SSE
+register, so 4 noise values cost about as much as one from a scalar generator.
+*/
+class SIMDNoiseGenerator
+{
+  public:
+    SIMDNoiseGenerator(uint32_t seed = 1) { setSeed(seed); }
+    void setSeed(uint32_t seed)
+    {
+        // xorshift needs nonzero states, these are spread out with the golden ratio hash
+        uint32_t s[4];
+        for (int i = 0; i < 4; ++i)
+        {
+            s[i] = (seed + i + 1) * 2654435761u;
+            if (s[i] == 0)
+                s[i] = 1;
+        }
+        m_state = _mm_set_epi32(s[3], s[2], s[1], s[0]);
+    }
+    // 4 values in the range -1..1
+    __m128 next()
+    {
+        __m128i x = m_state;
+        x = _mm_xor_si128(x, _mm_slli_epi32(x, 13));
+        x = _mm_xor_si128(x, _mm_srli_epi32(x, 17));
+        x = _mm_xor_si128(x, _mm_slli_epi32(x, 5));
+        m_state = x;
+        // the top 23 bits as the mantissa of a float in 1..2
+        __m128i bits = _mm_or_si128(_mm_srli_epi32(x, 9), _mm_set1_epi32(0x3f800000));
+        __m128 f = _mm_castsi128_ps(bits);
+        return _mm_sub_ps(_mm_mul_ps(f, _mm_set1_ps(2.0f)), _mm_set1_ps(3.0f));
+    }
+    // numvalues must be a multiple of 4
+    void fill(float *dest, int numvalues)
+    {
+        for (int i = 0; i < numvalues; i += 4)
+            _mm_storeu_ps(&dest[i], next());
+    }
+
+  private:
+    __m128i m_state;
+};
+
+/*
+Noise amplitude modulators for bandwidth enhanced partials, in the manner of the Loris
+synthesis model : a partial with bandwidth B is sin(phase) * (sqrt(1 - B) + sqrt(2 B) * n(t)),
+where n is narrow band noise with variance 1/2, which keeps the energy of the partial the same
+regardless of B.
+
+The modulators are run in lanes matching the oscillator lanes of the voice, 4 lanes at a time.
+The narrow band noise is white noise through a one pole lowpass, so after the modulation each
+partial is spread over a band around its frequency.
+*/
+template <int MaxLanes> class BandwidthNoiseBank
+{
+  public:
+    static_assert(MaxLanes % 4 == 0);
+    BandwidthNoiseBank()
+    {
+        m_filter_states.fill(0.0f);
+        m_carrier_gains.fill(1.0f);
+        m_noise_gains.fill(0.0f);
+    }
+    void setSeed(uint32_t seed) { m_noise.setSeed(seed); }
+    void setFilterCutoff(float hz, double samplerate)
+    {
+        float a = std::exp(-2.0 * M_PI * hz / samplerate);
+        m_filter_coeff = 1.0f - a;
+        // uniform noise has variance 1/3, the filter scales it by (1 - a) / (1 + a)
+        m_noise_scaler = std::sqrt(1.5f * (1.0f + a) / (1.0f - a));
+    }
+    // the bandwidth for a lane, 0 is a pure sinusoid and 1 is only noise
+    void setLaneBandwidth(int lane, float bandwidth)
+    {
+        m_carrier_gains[lane] = std::sqrt(1.0f - bandwidth);
+        m_noise_gains[lane] = std::sqrt(2.0f * bandwidth) * m_noise_scaler;
+    }
+    // moves the filter states between lanes, lane i takes the state of lane source[i], or starts
+    // from zero if that's -1. keeps the noise of a partial continuous when it moves to another
+    // lane
+    void remapLanes(const int *source, int numlanes)
+    {
+        const auto old = m_filter_states;
+        for (int i = 0; i < numlanes; ++i)
+            m_filter_states[i] = source[i] >= 0 ? old[source[i]] : 0.0f;
+    }
+    // multiplies the oscillator outputs with the modulators, numlanes must be a multiple of 4
+    void process(float *oscoutputs, int numlanes)
+    {
+        const __m128 coeff = _mm_set1_ps(m_filter_coeff);
+        for (int i = 0; i < numlanes; i += 4)
+        {
+            __m128 state = _mm_load_ps(&m_filter_states[i]);
+            state = _mm_add_ps(state, _mm_mul_ps(coeff, _mm_sub_ps(m_noise.next(), state)));
+            _mm_store_ps(&m_filter_states[i], state);
+            __m128 mod = _mm_add_ps(_mm_load_ps(&m_carrier_gains[i]),
+                                    _mm_mul_ps(_mm_load_ps(&m_noise_gains[i]), state));
+            _mm_store_ps(&oscoutputs[i], _mm_mul_ps(_mm_load_ps(&oscoutputs[i]), mod));
+        }
+    }
+
+  private:
+    SIMDNoiseGenerator m_noise;
+    float m_filter_coeff = 0.1f;
+    float m_noise_scaler = 1.0f;
+    alignas(16) std::array<float, MaxLanes> m_filter_states;
+    alignas(16) std::array<float, MaxLanes> m_carrier_gains;
+    alignas(16) std::array<float, MaxLanes> m_noise_gains;
+};
@@ -0,0 +1,131 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <emmintrin.h>
+
+/*
+Separate attack, decay, sustain and release envelopes for each partial of a voice, advanced once
+per control block. The envelope states are stored as arrays per stage parameter (structure of
+arrays), so the bank is advanced 4 partials at a time with SSE, without branching on the
+envelope stages of the individual partials.
+
+The decay and release times are scaled per partial with (partial number)^-tilt, so with a
+positive tilt the higher partials die away faster, like in plucked and struck sounds.
+The decays are exponential, the times are to -60 dB.
+*/
+class PartialEnvelopeBank
+{
+  public:
+    static constexpr int maxpartials = 64;
+    struct Parameters
+    {
+        // in seconds
+        float attack = 0.001f;
+        float decay = 1.0f;
+        float sustain = 0.0f;
+        float release = 0.5f;
+        float tilt = 0.5f;
+        bool operator==(const Parameters &) const = default;
+    };
+    PartialEnvelopeBank()
+    {
+        m_levels.fill(1.0f);
+        m_block_max.fill(1.0f);
+        m_attacking.fill(0.0f);
+        m_attack_incs.fill(1.0f);
+        m_decay_coeffs.fill(0.0f);
+        m_release_coeffs.fill(0.0f);
+    }
+    // when not enabled, all the levels are 1
+    void setEnabled(bool b)
+    {
+        if (b == m_enabled)
+            return;
+        m_enabled = b;
+        if (!m_enabled)
+        {
+            m_levels.fill(1.0f);
+            m_block_max.fill(1.0f);
+        }
+    }
+    bool isEnabled() const { return m_enabled; }
+    // only recalculates the coefficients if something changed
+    void setParameters(const Parameters &pars, double controlrate)
+    {
+        if (pars == m_pars && controlrate == m_control_rate)
+            return;
+        m_pars = pars;
+        m_control_rate = controlrate;
+        const float minblocks = 1.0f;
+        float attackblocks = std::max<float>(pars.attack * controlrate, minblocks);
+        for (int i = 0; i < maxpartials; ++i)
+        {
+            float scale = std::pow((float)(i + 1), -pars.tilt);
+            float decayblocks = std::max<float>(pars.decay * scale * controlrate, minblocks);
+            float releaseblocks = std::max<float>(pars.release * scale * controlrate, minblocks);
+            m_attack_incs[i] = 1.0f / attackblocks;
+            m_decay_coeffs[i] = std::pow(0.001f, 1.0f / decayblocks);
+            m_release_coeffs[i] = std::pow(0.001f, 1.0f / releaseblocks);
+        }
+    }
+    void noteOn()
+    {
+        m_released = false;
+        if (!m_enabled)
+            return;
+        m_levels.fill(0.0f);
+        m_attacking.fill(1.0f);
+    }
+    void noteOff() { m_released = true; }
+    // advances the envelopes by one control block
+    void process(int numpartials)
+    {
+        if (!m_enabled)
+            return;
+        const __m128 one = _mm_set1_ps(1.0f);
+        const __m128 sustain = _mm_set1_ps(m_pars.sustain);
+        for (int i = 0; i < numpartials; i += 4)
+        {
+            __m128 level = _mm_load_ps(&m_levels[i]);
+            __m128 newlevel;
+            if (m_released)
+            {
+                newlevel = _mm_mul_ps(level, _mm_load_ps(&m_release_coeffs[i]));
+            }
+            else
+            {
+                // both the attack and decay are calculated and the attacking lanes are selected
+                // with a mask
+                __m128 attacking = _mm_cmpgt_ps(_mm_load_ps(&m_attacking[i]), _mm_setzero_ps());
+                __m128 att = _mm_min_ps(_mm_add_ps(level, _mm_load_ps(&m_attack_incs[i])), one);
+                __m128 decaycoeffs = _mm_load_ps(&m_decay_coeffs[i]);
+                __m128 dec = _mm_add_ps(sustain, _mm_mul_ps(_mm_sub_ps(level, sustain), decaycoeffs));
+                newlevel = _mm_or_ps(_mm_and_ps(attacking, att), _mm_andnot_ps(attacking, dec));
+                // the attack ends when the level reaches 1
+                __m128 stillattacking = _mm_and_ps(attacking, _mm_cmplt_ps(att, one));
+                _mm_store_ps(&m_attacking[i], _mm_and_ps(stillattacking, one));
+            }
+            _mm_store_ps(&m_levels[i], newlevel);
+            _mm_store_ps(&m_block_max[i], _mm_max_ps(level, newlevel));
+        }
+    }
+    // the levels at the end of the latest processed block
+    const float *getLevels() const { return m_levels.data(); }
+    // the highest level of each partial during the latest processed block
+    const float *getBlockMaxLevels() const { return m_block_max.data(); }
+
+  private:
+    bool m_enabled = false;
+    bool m_released = false;
+    Parameters m_pars;
+    double m_control_rate = 0.0;
+    alignas(16) std::array<float, maxpartials> m_levels;
+    alignas(16) std::array<float, maxpartials> m_block_max;
+    // 1 for the partials still in the attack stage, 0 for others
+    alignas(16) std::array<float, maxpartials> m_attacking;
+    alignas(16) std::array<float, maxpartials> m_attack_incs;
+    alignas(16) std::array<float, maxpartials> m_decay_coeffs;
+    alignas(16) std::array<float, maxpartials> m_release_coeffs;
+};
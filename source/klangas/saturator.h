@@ -0,0 +1,178 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <vector>
+#include <cmath>
+#include "fastmath.h"
+
+/*
+2x up/downsampler with a windowed sinc halfband lowpass. In a halfband filter every other
+coefficient is zero, except the center one, so both directions reduce to a single 24 tap
+dot product (done with SSE) per original rate sample, plus the center tap which is just
+a delayed sample.
+*/
+class HalfbandResampler
+{
+  public:
+    static constexpr int numtaps = 47;
+    HalfbandResampler()
+    {
+        double coeffs[numtaps];
+        double sum = 0.0;
+        for (int i = 0; i < numtaps; ++i)
+        {
+            double n = i - center;
+            // cutoff at half of the original Nyquist
+            double sinc = n == 0 ? 0.5 : std::sin(M_PI * 0.5 * n) / (M_PI * n);
+            // Blackman window
+            double w = 0.42 - 0.5 * std::cos(2 * M_PI * i / (numtaps - 1)) +
+                       0.08 * std::cos(4 * M_PI * i / (numtaps - 1));
+            coeffs[i] = sinc * w;
+            sum += coeffs[i];
+        }
+        // the even coefficients reversed, so they can be applied directly to the history
+        // which goes from oldest to newest
+        for (int i = 0; i < numphasetaps; ++i)
+            m_phase_coeffs[numphasetaps - 1 - i] = coeffs[2 * i] / sum;
+        m_center_coeff = coeffs[center] / sum;
+        reset();
+    }
+    void reset()
+    {
+        m_up_work.fill(0.0f);
+        m_down_work[0].fill(0.0f);
+        m_down_work[1].fill(0.0f);
+    }
+    // out must have space for 2 * numsamples
+    void upsample(const float *in, float *out, int numsamples)
+    {
+        for (int pos = 0; pos < numsamples; pos += chunksize)
+        {
+            int n = std::min(chunksize, numsamples - pos);
+            std::copy(in + pos, in + pos + n, m_up_work.begin() + historylen);
+            for (int i = 0; i < n; ++i)
+            {
+                // window of the latest numphasetaps samples, from oldest to newest
+                const float *h = &m_up_work[i];
+                // gain of 2 to make up for the zero stuffing
+                out[2 * (pos + i)] = 2.0f * dot(h);
+                out[2 * (pos + i) + 1] = 2.0f * m_center_coeff * h[numphasetaps - 1 - center / 2];
+            }
+            keepHistory(m_up_work, n);
+        }
+    }
+    // in has 2 * numsamples samples
+    void downsample(const float *in, float *out, int numsamples)
+    {
+        for (int pos = 0; pos < numsamples; pos += chunksize)
+        {
+            int n = std::min(chunksize, numsamples - pos);
+            // even and odd input samples are kept separately, the even coefficients only apply
+            // to the latest sample and every second one before it
+            for (int i = 0; i < n; ++i)
+            {
+                m_down_work[0][historylen + i] = in[2 * (pos + i)];
+                m_down_work[1][historylen + i] = in[2 * (pos + i) + 1];
+            }
+            for (int i = 0; i < n; ++i)
+            {
+                const float *h0 = &m_down_work[0][i];
+                const float *h1 = &m_down_work[1][i];
+                out[pos + i] = dot(h1) + m_center_coeff * h0[numphasetaps - 1 - center / 2];
+            }
+            keepHistory(m_down_work[0], n);
+            keepHistory(m_down_work[1], n);
+        }
+    }
+
+  private:
+    static constexpr int center = numtaps / 2;
+    static constexpr int numphasetaps = (numtaps + 1) / 2;
+    static_assert(numphasetaps % 4 == 0);
+    // the input is processed in chunks appended after the history, so the filter windows can
+    // be read linearly. writing each sample into a ring buffer just before reading it back
+    // with vector loads would stall on store forwarding
+    static constexpr int chunksize = 64;
+    static constexpr int historylen = numphasetaps - 1;
+    using WorkBuffer = std::array<float, historylen + chunksize>;
+    static void keepHistory(WorkBuffer &buf, int n)
+    {
+        std::copy(buf.begin() + n, buf.begin() + n + historylen, buf.begin());
+    }
+    float dot(const float *h) const
+    {
+        __m128 acc = _mm_setzero_ps();
+        for (int j = 0; j < numphasetaps; j += 4)
+            acc = _mm_add_ps(acc, _mm_mul_ps(_mm_load_ps(&m_phase_coeffs[j]), _mm_loadu_ps(&h[j])));
+        alignas(16) float sums[4];
+        _mm_store_ps(sums, acc);
+        return (sums[0] + sums[1]) + (sums[2] + sums[3]);
+    }
+    alignas(16) std::array<float, numphasetaps> m_phase_coeffs;
+    float m_center_coeff = 0.5f;
+    WorkBuffer m_up_work;
+    std::array<WorkBuffer, 2> m_down_work;
+};
+
+/*
+Mono tanh saturator, optionally oversampled 2x or 4x to reduce the aliasing.
+The tanh itself is always the SIMD rational approximation processing the whole block.
+*/
+class OversampledSaturator
+{
+  public:
+    // allocates, so not to be called from the audio thread
+    void prepare(int maxblocksize)
+    {
+        m_os_buf0.resize(maxblocksize * 4);
+        m_os_buf1.resize(maxblocksize * 4);
+        reset();
+    }
+    void reset()
+    {
+        for (auto &r : m_resamplers)
+            r.reset();
+    }
+    // 1, 2 or 4. changing the factor resets the filters
+    void setOversampling(int factor)
+    {
+        if (factor != 1 && factor != 2 && factor != 4)
+            factor = 1;
+        if (factor != m_factor)
+        {
+            m_factor = factor;
+            reset();
+        }
+    }
+    int getOversampling() const { return m_factor; }
+    // in place, numsamples must not exceed the prepared block size
+    void process(float *data, int numsamples)
+    {
+        if (m_factor == 1)
+        {
+            xenakios::fasttanh_block(data, numsamples);
+        }
+        else if (m_factor == 2)
+        {
+            m_resamplers[0].upsample(data, m_os_buf0.data(), numsamples);
+            xenakios::fasttanh_block(m_os_buf0.data(), numsamples * 2);
+            m_resamplers[0].downsample(m_os_buf0.data(), data, numsamples);
+        }
+        else
+        {
+            m_resamplers[0].upsample(data, m_os_buf0.data(), numsamples);
+            m_resamplers[1].upsample(m_os_buf0.data(), m_os_buf1.data(), numsamples * 2);
+            xenakios::fasttanh_block(m_os_buf1.data(), numsamples * 4);
+            m_resamplers[1].downsample(m_os_buf1.data(), m_os_buf0.data(), numsamples * 2);
+            m_resamplers[0].downsample(m_os_buf0.data(), data, numsamples);
+        }
+    }
+
+  private:
+    int m_factor = 1;
+    // the first stage resamplers are used for both 2x and 4x, the second only for 4x
+    HalfbandResampler m_resamplers[2];
+    std::vector<float> m_os_buf0;
+    std::vector<float> m_os_buf1;
+};
@@ -5,6 +5,8 @@
 #include "avx_mathfun.h"
 #endif
 #include <sse_mathfun.h>
+#include <bit>
+#include <sstream>
 // #include "BinaryData.h"
 #ifdef HAVEJUCE
 AdditiveSharedData::MorphTableType AdditiveSharedData::readFromFile(juce::File f)
@@ -82,17 +84,72 @@ juce::String AdditiveSharedData::getTableAsText(const AdditiveSharedData::MorphT
 }
 #endif
 
+// depths has the matrix source after source
+static std::unique_ptr<AdditiveSharedData::CompiledModMatrix> compileModMatrix(const float *depths)
+{
+    using SD = AdditiveSharedData;
+    auto compiled = std::make_unique<SD::CompiledModMatrix>();
+    for (int i = 0; i < SD::MOS_LAST; ++i)
+    {
+        for (int j = 0; j < SD::MOT_LAST; ++j)
+        {
+            float depth = depths[i * SD::MOT_LAST + j];
+            if (depth != 0.0f)
+            {
+                compiled->routings[compiled->numroutings] = {i, j, depth};
+                ++compiled->numroutings;
+            }
+        }
+    }
+    return compiled;
+}
+
+void AdditiveSharedData::setModulationDepth(int source, int target, float amount)
+{
+    if (source < 0 || source >= MOS_LAST || target < 0 || target >= MOT_LAST)
+        return;
+    std::unique_ptr<CompiledModMatrix> compiled;
+    {
+        std::lock_guard<std::mutex> locker(m_modmatrix_mutex);
+        modmatrix[source][target] = amount;
+        compiled = compileModMatrix(&modmatrix[0][0]);
+    }
+    m_modmatrix_exchange.publish(std::move(compiled));
+}
+
+std::vector<float> AdditiveSharedData::getModulationDepths()
+{
+    std::lock_guard<std::mutex> locker(m_modmatrix_mutex);
+    return std::vector<float>(&modmatrix[0][0], &modmatrix[0][0] + (int)MOS_LAST * (int)MOT_LAST);
+}
+
+void AdditiveSharedData::setModulationDepths(const std::vector<float> &depths)
+{
+    std::unique_ptr<CompiledModMatrix> compiled;
+    {
+        std::lock_guard<std::mutex> locker(m_modmatrix_mutex);
+        // missing depths are cleared
+        for (int i = 0; i < (int)MOS_LAST * (int)MOT_LAST; ++i)
+            (&modmatrix[0][0])[i] = i < (int)depths.size() ? depths[i] : 0.0f;
+        compiled = compileModMatrix(&modmatrix[0][0]);
+    }
+    m_modmatrix_exchange.publish(std::move(compiled));
+}
+
 void AdditiveSharedData::setPanMorphPreset(int index)
 {
     if (index < 0 || index >= num_panpresets)
         return;
-    partialspanmorphtable = pan_morph_presets[index];
+    partialspanmorphtable = m_tables->pan_morph_presets[index];
     partialspanmorphtable[maxpanframes] = partialspanmorphtable[maxpanframes - 1];
 }
 
 void AdditiveSharedData::setVolumeMorphPreset(int index)
 {
-    if (index < 0 || index > numamppresets)
+    if (index < 0 || index > loaded_morph_table_preset)
+        return;
+    m_use_loaded_morph_table = index == loaded_morph_table_preset;
+    if (m_use_loaded_morph_table)
         return;
     if (index == numamppresets)
     {
@@ -100,7 +157,7 @@ void AdditiveSharedData::setVolumeMorphPreset(int index)
         updateExtraMorphFrame();
         return;
     }
-    partialsmorphtable = volumepresets[index];
+    partialsmorphtable = m_tables->volumepresets[index];
     updateExtraMorphFrame();
 }
 
@@ -110,28 +167,31 @@ float AdditiveSharedData::getSafetyFilterCoefficient(float hz)
     if (hz <= minpartialfrequency || hz >= maxpartialfrequency)
         return 0.0f;
     int index = (int)xenakios::mapvalue<float>(hz, minpartialfrequency, maxpartialfrequency, 0.0f,
-                                               safety_filter.size() - 1);
-    assert(index >= 0 && index < safety_filter.size());
+                                               m_tables->safety_filter.size() - 1);
+    assert(index >= 0 && index < m_tables->safety_filter.size());
     // index = xenakios::jlimit<int>(0,safety_filter.size()-1,index);
-    return safety_filter[index];
+    return m_tables->safety_filter[index];
 }
 
-AdditiveSharedData::AdditiveSharedData()
+const AdditiveStaticTables &AdditiveStaticTables::get()
+{
+    // initialization of function local statics is thread safe, so concurrently created
+    // instances all wait for the same tables to be generated
+    static const AdditiveStaticTables tables;
+    return tables;
+}
+
+AdditiveStaticTables::AdditiveStaticTables()
 {
-    for (int i = 0; i < AdditiveSharedData::MOS_LAST; ++i)
-        for (int j = 0; j < AdditiveSharedData::MOT_LAST; ++j)
-            modmatrix[i][j] = 0.0f;
-    low_cutoff = 20.0f;
-    high_cutoff = 15000.0f;
     for (int i = 0; i < safety_filter.size(); ++i)
     {
         float hz = xenakios::mapvalue<float>(i, 0, safety_filter.size() - 1, minpartialfrequency,
                                              maxpartialfrequency);
         float gain = 1.0f;
-        if (hz <= low_cutoff)
-            gain = xenakios::mapvalue(hz, minpartialfrequency, low_cutoff, 0.0f, 1.0f);
-        else if (hz >= high_cutoff)
-            gain = xenakios::mapvalue(hz, high_cutoff, maxpartialfrequency, 1.0f, 0.0f);
+        if (hz <= safety_low_cutoff)
+            gain = xenakios::mapvalue(hz, minpartialfrequency, safety_low_cutoff, 0.0f, 1.0f);
+        else if (hz >= safety_high_cutoff)
+            gain = xenakios::mapvalue(hz, safety_high_cutoff, maxpartialfrequency, 1.0f, 0.0f);
         assert(gain >= 0.0f && gain <= 1.0f);
         safety_filter[i] = gain;
     }
@@ -154,6 +214,80 @@ AdditiveSharedData::AdditiveSharedData()
         pan_coefficients[0][i] = leftValue * boostValue;
         pan_coefficients[1][i] = rightValue * boostValue;
     }
+    generateAmplitudeMorphTablePresets();
+    generatePanMorphTablePresets();
+    // the random filter gains need to be ready before this
+    generateShapingFilterTables();
+    generateFreqTweakTables();
+}
+
+void AdditiveStaticTables::generateFreqTweakTables()
+{
+    float subharms[64];
+    // 1   2   3   4   5 6 7 8 9
+    // 1/5 1/4 1/3 1/2 1 2 3 4 5
+    for (int i = 0; i < 64; ++i)
+    {
+        if (i < 6)
+            subharms[i] = 1.0 / (6 - i);
+        else
+            subharms[i] = i - 4;
+    }
+    for (int i = 0; i < numtablepartials; ++i)
+    {
+        float orig = i + 1;
+        float target = subharms[i];
+        freq_tweak_ratios[0][i] = target / orig;
+        freq_tweak_ratios[2][i] = 1.0 / (i + 1);
+    }
+    std::default_random_engine rng(2024);
+    std::normal_distribution<float> norm(0.0, 12.0);
+    for (auto &table : random_freq_tweak_ratios)
+        for (int i = 0; i < numtablepartials; ++i)
+            table[i] = std::pow(2.0, 1.0 / 12.0 * norm(rng));
+    freq_tweak_ratios[random_freq_tweak_mode] = random_freq_tweak_ratios[0];
+    for (int i = 0; i < numtablepartials; i += 2)
+    {
+        int partnum = i + 1;
+        float orig0 = partnum;
+        float target0 = partnum + 1;
+        float orig1 = partnum + 1;
+        float target1 = partnum;
+        freq_tweak_ratios[3][i + 0] = target0 / orig0;
+        freq_tweak_ratios[3][i + 1] = target1 / orig1;
+    }
+    for (int i = 0; i < numtablepartials; ++i)
+    {
+        int partnum = i + 1;
+        float orig = partnum;
+        float target = 65 - partnum;
+        freq_tweak_ratios[4][i] = target / orig;
+    }
+    for (int i = 0; i < numtablepartials; ++i)
+    {
+        int partnum = i + 1;
+        if (partnum < 17)
+        {
+            // no changes for the lowerst 16 ones
+            freq_tweak_ratios[5][i] = 1.0f;
+        }
+        else
+        {
+            // let's extend...
+            int extendnum = 17 + (partnum - 17) * 4;
+            float orig = partnum;
+            float target = extendnum;
+            freq_tweak_ratios[5][i] = target / orig;
+        }
+    }
+}
+
+AdditiveSharedData::AdditiveSharedData() : m_tables(&AdditiveStaticTables::get())
+{
+    for (int i = 0; i < AdditiveSharedData::MOS_LAST; ++i)
+        for (int j = 0; j < AdditiveSharedData::MOT_LAST; ++j)
+            modmatrix[i][j] = 0.0f;
+    m_modmatrix_exchange.setImmediately(std::make_unique<CompiledModMatrix>());
     for (int i = 0; i < maxampframes; ++i)
     {
         for (int j = 0; j < 64; ++j)
@@ -161,15 +295,14 @@ AdditiveSharedData::AdditiveSharedData()
             partialsmorphtable[i][j] = 0.0f;
         }
     }
-    generateAmplitudeMorphTablePresets();
-    generatePanMorphTablePresets();
     // initKeyMapEDO(440.0,1200.0,12);
+    Tunings::Tuning initial_tuning;
     try
     {
         // kbm = Tunings::readKBMFile("C:\\develop\\AdditiveSynth\\KBM\\31edo_hex.kbm");
         m_using_custom_kbm = false;
         // tuning = Tunings::Tuning(Tunings::evenTemperament12NoteScale(),kbm);
-        fundamental_tuning = Tunings::Tuning(Tunings::evenDivisionOfCentsByM(1200.0, 31), kbm);
+        initial_tuning = Tunings::Tuning(Tunings::evenDivisionOfCentsByM(1200.0, 31), kbm);
 
         /*
         juce::String txt;
@@ -184,6 +317,10 @@ AdditiveSharedData::AdditiveSharedData()
     {
         std::cerr << e.what() << '\n';
     }
+    // audio isn't running yet, so we can set the initial snapshot directly
+    m_latest_published_tuning = initial_tuning;
+    m_tuning_exchange.setImmediately(
+        std::make_unique<TuningSnapshot>(initial_tuning, m_tuning_serial++));
     // initKeyMapFromScala(440.0,1200.0,"C:\\develop\\AdditiveSynth\\scala\\ED2-23_MOS-9_Ch-8_13o23_678.261.scl");
     //  init user custom volumes morph table to fundamentals at maximum
     for (int i = 0; i < maxampframes; ++i)
@@ -199,7 +336,7 @@ AdditiveSharedData::AdditiveSharedData()
     m_custom_morph_table_dirty = true;
 }
 
-void AdditiveSharedData::generatePanMorphTablePresets()
+void AdditiveStaticTables::generatePanMorphTablePresets()
 {
     std::minstd_rand0 rng{763};
     std::uniform_real_distribution<float> dist{0.0f, 1.0f};
@@ -231,7 +368,7 @@ void AdditiveSharedData::generatePanMorphTablePresets()
     }
 }
 
-void AdditiveSharedData::generateAmplitudeMorphTablePresets()
+void AdditiveStaticTables::generateAmplitudeMorphTablePresets()
 {
     std::default_random_engine rng(78901);
     std::uniform_real_distribution<float> uni(-48.0f, 0.0f);
@@ -350,19 +487,39 @@ void AdditiveSharedData::updateExtraMorphFrame()
     partialsmorphtable[maxampframes] = partialsmorphtable[maxampframes - 1];
 }
 
-void AdditiveSharedData::initKeyMapFromScala(double referenceFrequency, double pseudoOctave,
-                                             std::string fn)
+TuningSnapshot::TuningSnapshot(const Tunings::Tuning &t, uint64_t serial_)
+    : tuning(t), serial(serial_)
 {
-    double pseudoOctaveRatio = std::pow(2.0, (pseudoOctave / 1200.0));
-    try
-    {
-        auto scale = Tunings::readSCLFile(fn);
-        fundamental_tuning = Tunings::Tuning(scale);
-    }
-    catch (const std::exception &e)
-    {
-        std::cerr << e.what() << '\n';
-    }
+    for (int i = 0; i < numkeys; ++i)
+        key_pitches[i] = tuning.logScaledFrequencyForMidiNote(firstkey + i) * 12;
+    key_pitches[numkeys] = key_pitches[numkeys - 1];
+}
+
+std::string TuningSnapshot::validate() const
+{
+    const auto &tones = tuning.scale.tones;
+    // a scale that doesn't go up over its period maps all the keys into a single band
+    if (tones.empty() || !(tones.back().cents > 0.0))
+        return "The scale period must be larger than 0 cents";
+    for (float p : key_pitches)
+        if (!std::isfinite(p))
+            return "The tuning has keys with invalid frequencies";
+    return {};
+}
+
+std::string AdditiveSharedData::publishTuning(const Tunings::Tuning &tuning)
+{
+    // the snapshot is built and validated here on the caller's thread, the audio thread only
+    // swaps a pointer
+    std::lock_guard<std::mutex> locker(m_tuning_publish_mutex);
+    auto snapshot = std::make_unique<TuningSnapshot>(tuning, m_tuning_serial);
+    auto error = snapshot->validate();
+    if (!error.empty())
+        return error;
+    ++m_tuning_serial;
+    m_latest_published_tuning = tuning;
+    m_tuning_exchange.publish(std::move(snapshot));
+    return {};
 }
 
 void AdditiveSharedData::initKeyMapEDO(double referenceFrequency, double pseudoOctave, int edo)
@@ -377,16 +534,15 @@ void AdditiveSharedData::initKeyMapEDO(double referenceFrequency, double pseudoO
     */
 }
 
-float AdditiveVoice::getShapingFilterGain(float hz)
+float AdditiveStaticTables::calculateShapingFilterGain(int mode, float octave, float morph) const
 {
-    float octave = AdditiveSharedData::frequencyAsOctave(hz);
-    if (m_filter_mode == 0 || m_filter_mode == 1)
+    if (mode == 0 || mode == 1)
     {
         // the calculations might not be completely right, but it would be something like this
-        float cutoff = 11.0f * m_filter_morph_mod;
+        float cutoff = 11.0f * morph;
         if (octave >= cutoff)
         {
-            int order = (m_filter_mode + 1) * 2;
+            int order = (mode + 1) * 2;
             float diff = octave - cutoff;
             float g = 1.0 / (std::pow(2.0f, diff * order));
             g = xenakios::jlimit(0.0f, 1.0f, g);
@@ -394,125 +550,146 @@ float AdditiveVoice::getShapingFilterGain(float hz)
         }
         return 1.0f;
     }
-    else if (m_filter_mode == 2)
+    else if (mode == 2)
     {
-        float offset = M_PI * 2 * m_filter_morph_mod;
+        float offset = M_PI * 2 * morph;
         float g = 0.5f + 0.5f * std::sin(M_PI * 2 / 11 * octave * 8 + offset);
         g = xenakios::jlimit(0.0f, 1.0f, g);
         return g;
     }
-    else if (m_filter_mode == 3)
+    else if (mode == 3)
     {
-        float offset = m_filter_morph_mod;
+        float offset = morph;
         float g = std::fmod(octave + offset, 1.0f);
         g = xenakios::jlimit(0.0f, 1.0f, g);
         return g;
     }
-    else if (m_filter_mode == 4)
+    else if (mode == 4)
     {
-        float tablpos = octave * 2.0 + m_filter_morph_mod * 32;
+        float tablpos = octave * 2.0 + morph * 32;
         tablpos = std::fmod(tablpos, 62.0f);
         int i0 = tablpos;
         int i1 = i0 + 1;
         float frac = tablpos - i0;
-        float v0 = m_shared_data->voice_random_filter_gains[i0];
-        float v1 = m_shared_data->voice_random_filter_gains[i1];
+        float v0 = voice_random_filter_gains[i0];
+        float v1 = voice_random_filter_gains[i1];
         float g = v0 + (v1 - v0) * frac;
         g = xenakios::jlimit(0.0f, 1.0f, g);
         return g;
-        float octave_min = 5.0 + m_filter_morph_mod * 2;
-        float octave_max = 6.0 + m_filter_morph_mod * 2;
+        float octave_min = 5.0 + morph * 2;
+        float octave_max = 6.0 + morph * 2;
         float gain0 = 0.0f;
         if (octave >= octave_min && octave < octave_max)
             gain0 = 0.0f;
         else
             gain0 = 1.0f;
-        float periods = 8.0; // 4.0+4.0*m_filter_morph_mod;
-        float offset = M_PI * 2 * m_filter_morph_mod;
+        float periods = 8.0; // 4.0+4.0*morph;
+        float offset = M_PI * 2 * morph;
         float gain1 = 0.5f + 0.5f * std::sin(octave * periods + offset);
-        return gain0 + (gain1 - gain0) * m_filter_morph_mod;
+        return gain0 + (gain1 - gain0) * morph;
     }
     return 1.0f;
 }
 
-AdditiveVoice::AdditiveVoice()
+void AdditiveStaticTables::generateShapingFilterTables()
+{
+    for (int mode = 0; mode < num_shaping_filter_modes; ++mode)
+    {
+        auto &table = shaping_filter_tables[mode];
+        for (int i = 0; i < shaping_filter_morph_points; ++i)
+        {
+            float morph = 1.0f / (shaping_filter_morph_points - 1) * i;
+            for (int j = 0; j < shaping_filter_octave_points; ++j)
+            {
+                float octave = maxpartialoctave / (shaping_filter_octave_points - 1) * j;
+                table[i][j] = calculateShapingFilterGain(mode, octave, morph);
+            }
+            table[i][shaping_filter_octave_points] = table[i][shaping_filter_octave_points - 1];
+        }
+        table[shaping_filter_morph_points] = table[shaping_filter_morph_points - 1];
+    }
+}
+
+void AdditiveSharedData::getShapingFilterGains(int mode, float morph, const float *hz, float *gains,
+                                               int numpartials) const
 {
-    for (int i = 0; i < m_lfo_rates.size(); ++i)
+    if (mode < 0 || mode >= num_shaping_filter_modes)
+    {
+        std::fill(gains, gains + numpartials, 1.0f);
+        return;
+    }
+    // morph is the same for all the partials, so we get the 2 table rows to use once
+    float morphpos = xenakios::jlimit(0.0f, 1.0f, morph) * (AdditiveStaticTables::shaping_filter_morph_points - 1);
+    int m0 = morphpos;
+    const auto &row0 = m_tables->shaping_filter_tables[mode][m0];
+    const auto &row1 = m_tables->shaping_filter_tables[mode][m0 + 1];
+    const __m128 morphfrac = _mm_set1_ps(morphpos - m0);
+    const __m128 invminfreq = _mm_set1_ps(1.0f / minpartialfrequency);
+    // log2(x) = ln(x) / ln(2), and then scaled to the table size
+    const __m128 octscaler =
+        _mm_set1_ps(1.0f / std::log(2.0f) * (AdditiveStaticTables::shaping_filter_octave_points - 1) / AdditiveStaticTables::maxpartialoctave);
+    const __m128 zero = _mm_setzero_ps();
+    const __m128 maxpos = _mm_set1_ps(AdditiveStaticTables::shaping_filter_octave_points - 1);
+    alignas(16) int32_t indices[4];
+    alignas(16) float v00[4], v01[4], v10[4], v11[4];
+    for (int i = 0; i < numpartials; i += 4)
     {
-        m_lfo_rates[i] = 1.0;
-        m_lfo_types[i] = 0;
-        m_lfo_deforms[i] = 0.0;
+        __m128 pos = _mm_mul_ps(_mm_loadu_ps(&hz[i]), invminfreq);
+        pos = _mm_mul_ps(sse_mathfun_log_ps(pos), octscaler);
+        pos = _mm_min_ps(_mm_max_ps(pos, zero), maxpos);
+        __m128i ipos = _mm_cvttps_epi32(pos);
+        __m128 frac = _mm_sub_ps(pos, _mm_cvtepi32_ps(ipos));
+        _mm_store_si128((__m128i *)indices, ipos);
+        // no gathers in SSE, so the table values need to be loaded one by one
+        for (int j = 0; j < 4; ++j)
+        {
+            v00[j] = row0[indices[j]];
+            v01[j] = row0[indices[j] + 1];
+            v10[j] = row1[indices[j]];
+            v11[j] = row1[indices[j] + 1];
+        }
+        __m128 a = _mm_load_ps(v00);
+        a = _mm_add_ps(a, _mm_mul_ps(_mm_sub_ps(_mm_load_ps(v01), a), frac));
+        __m128 b = _mm_load_ps(v10);
+        b = _mm_add_ps(b, _mm_mul_ps(_mm_sub_ps(_mm_load_ps(v11), b), frac));
+        __m128 result = _mm_add_ps(a, _mm_mul_ps(_mm_sub_ps(b, a), morphfrac));
+        _mm_storeu_ps(&gains[i], result);
     }
+}
+
+AdditiveVoice::AdditiveVoice()
+{
+    m_lfo_params.rates.fill(1.0f);
     // should calculate this with proper filter math based on sample rate and desired smoothing rate
     m_gain_smoothing_coeff = 0.990f;
     m_pan_smoothing_coeff = 0.999f; // smooth pans slower
+    m_gain_smoothing_block_coeff = std::pow(m_gain_smoothing_coeff, SRProvider::BLOCK_SIZE);
 
-    std::default_random_engine rng((int64_t)this);
-    std::normal_distribution<float> norm(0.0, 12.0);
-    float subharms[64];
-    // 1   2   3   4   5 6 7 8 9
-    // 1/5 1/4 1/3 1/2 1 2 3 4 5
-    for (int i = 0; i < 64; ++i)
-    {
-        if (i < 6)
-            subharms[i] = 1.0 / (6 - i);
-        else
-            subharms[i] = i - 4;
-    }
     std::fill(m_output_samples.begin(), m_output_samples.end(), 0.0f);
     for (int i = 0; i < maxnumpartials; ++i)
     {
         m_partial_freqs[i] = 440.0;
-        m_partial_freqs_vis[i] = 440.0f;
         m_partial_phases[i] = 0.0;
         m_partial_phaseincs[i] = 0.0;
-        m_partial_amplitudes[i] = 0.0;
 
-        m_partial_pans[i] = 0.5f;
         m_partial_safetyfiltergains[i] = 0.0f;
         m_partial_shapingfiltergains[i] = 0.0f;
         m_partial_vol_smoothing_history[i] = 0.0f;
         m_partial_pan_smoothing_history[i] = 0.0f;
-        float orig = i + 1;
-        float target = subharms[i];
-        m_partial_freq_tweak_ratios[0][i] = target / orig;
-        m_partial_freq_tweak_ratios[1][i] = std::pow(2.0, 1.0 / 12.0 * norm(rng));
-        m_partial_freq_tweak_ratios[2][i] = 1.0 / (i + 1);
-    }
-    for (int i = 0; i < maxnumpartials; i += 2)
-    {
-        int partnum = i + 1;
-        float orig0 = partnum;
-        float target0 = partnum + 1;
-        float orig1 = partnum + 1;
-        float target1 = partnum;
-        m_partial_freq_tweak_ratios[3][i + 0] = target0 / orig0;
-        m_partial_freq_tweak_ratios[3][i + 1] = target1 / orig1;
-    }
-    for (int i = 0; i < maxnumpartials; ++i)
-    {
-        int partnum = i + 1;
-        float orig = partnum;
-        float target = 65 - partnum;
-        m_partial_freq_tweak_ratios[4][i] = target / orig;
-    }
-    for (int i = 0; i < maxnumpartials; ++i)
-    {
-        int partnum = i + 1;
-        if (partnum < 17)
-        {
-            // no changes for the lowerst 16 ones
-            m_partial_freq_tweak_ratios[5][i] = 1.0f;
-        }
-        else
-        {
-            // let's extend...
-            int extendnum = 17 + (partnum - 17) * 4;
-            float orig = partnum;
-            float target = extendnum;
-            m_partial_freq_tweak_ratios[5][i] = target / orig;
-        }
     }
+    resetUnisonPhases();
+    // the voices get the random tweak tables in turn, for some variation between the voices
+    static std::atomic<int> voicecounter{0};
+    const auto &tables = AdditiveStaticTables::get();
+    for (int i = 0; i < m_partial_freq_tweak_ratios.size(); ++i)
+        m_partial_freq_tweak_ratios[i] = tables.freq_tweak_ratios[i].data();
+    int voiceindex = voicecounter++;
+    int randomtable = voiceindex % AdditiveStaticTables::num_random_freq_tweak_tables;
+    m_partial_freq_tweak_ratios[AdditiveStaticTables::random_freq_tweak_mode] =
+        tables.random_freq_tweak_ratios[randomtable].data();
+    // different noise for each voice, otherwise chords would have correlated noise
+    m_noise_bank.setSeed(voiceindex);
+    m_noise_lane_oscs.fill(-1);
     output_frame[0] = 0.0f;
     output_frame[1] = 0.0f;
     output_frame[2] = 0.0f;
@@ -526,6 +703,11 @@ AdditiveVoice::AdditiveVoice()
     modulator_unipolar[AdditiveSharedData::MOS_CC_B] = true;
     modulator_unipolar[AdditiveSharedData::MOS_CC_C] = true;
     modulator_unipolar[AdditiveSharedData::MOS_CC_D] = true;
+    // the CC smoothers run once per control block
+    for (auto &sm : m_cc_smoothers)
+        sm.setSlope(std::pow(0.999, SRProvider::BLOCK_SIZE));
+    m_mod_dest_start.fill(0.0f);
+    m_mod_dest_end.fill(0.0f);
 }
 
 void AdditiveVoice::postProcessUpdate(int nframes)
@@ -534,13 +716,22 @@ void AdditiveVoice::postProcessUpdate(int nframes)
     // m_pitch_bend_smoother.skip(nframes - 1);
 }
 #pragma float_control(precise, off, push)
+void AdditiveVoice::updatePseudoOctaveRatios()
+{
+    float pseudoOctaveRatio = std::pow(2.0, (m_pseudo_octave / 1200.0));
+    for (int i = 0; i < maxnumpartials; ++i)
+        m_partial_po_ratios[i] = std::pow(pseudoOctaveRatio, std::log2(i + 1));
+    m_partial_po_ratios_octave = m_pseudo_octave;
+}
+
 void AdditiveVoice::updateState()
 {
     // m_frequencies_ready_to_show = true;
-    float pseudoOctaveRatio = std::pow(2.0, (m_pseudo_octave / 1200.0));
     // m_pitch_bend_smoother.setTargetValue(m_pitch_bend_amount);
     double pb = m_pitch_bend_amount;
-    double pitch = m_cur_midi_note + pb + m_pitch_lfo_mod + m_pitch_adjust_amount;
+    double pitchadjust =
+        m_pitch_adjust_amount + getParamModulation(&ParamModulation::pitch);
+    double pitch = m_cur_midi_note + pb + m_pitch_lfo_mod + pitchadjust;
     double mappedpitch = pitch;
     if (m_shared_data->m_quantize_pitch_mod_mode == 1)
         mappedpitch = m_shared_data->remapKeyInMidiOnlyMode(pitch);
@@ -548,21 +739,49 @@ void AdditiveVoice::updateState()
         mappedpitch = m_shared_data->remapKeyInMidiOnlyMode(std::round(pitch));
     else
         mappedpitch =
-            m_shared_data->remapKeyInMidiOnlyMode(m_cur_midi_note + m_pitch_adjust_amount) + pb +
+            m_shared_data->remapKeyInMidiOnlyMode(m_cur_midi_note + pitchadjust) + pb +
             m_pitch_lfo_mod;
-    m_fundamental_freq = Tunings::MIDI_0_FREQ * std::pow(2.0, 1.0 / 12 * mappedpitch);
+    m_fundamental_freq = Tunings::MIDI_0_FREQ * xenakios::fastexp2(1.0f / 12 * mappedpitch);
+
+    // the rest is only calculated for the stages whose inputs have changed since the last update
+    uint64_t ratios_serial = 0;
+    if (auto t = getFreqRatiosTable())
+        ratios_serial = t->getSerial();
+    PartialFreqInputs freqinputs{m_fundamental_freq, m_pseudo_octave,   m_freq_tweaks_mix_mod,
+                                 m_sr,               m_freq_tweaks_mode, m_num_partials,
+                                 m_tuning_mode,      m_edo,              ratios_serial};
+    bool freqs_changed = !(freqinputs == m_last_freq_inputs);
+    if (freqs_changed)
+    {
+        m_last_freq_inputs = freqinputs;
+        updatePartialFrequencies();
+    }
+    ShapingFilterInputs filterinputs{m_filter_morph_mod, m_filter_mode};
+    if (freqs_changed || !(filterinputs == m_last_filter_inputs))
+    {
+        m_last_filter_inputs = filterinputs;
+        m_shared_data->getShapingFilterGains(m_filter_mode, m_filter_morph_mod,
+                                             m_partial_freqs.data(),
+                                             m_partial_shapingfiltergains.data(), m_num_partials);
+    }
+}
+
+void AdditiveVoice::updatePartialFrequencies()
+{
     if (m_tuning_mode == 0)
     {
+        if (m_partial_po_ratios_octave != m_pseudo_octave)
+            updatePseudoOctaveRatios();
         for (int i = 0; i < m_num_partials; ++i)
         {
-            float hz = m_fundamental_freq * (std::pow(pseudoOctaveRatio, std::log2(i + 1)));
-            m_partial_freqs[i] = hz;
+            m_partial_freqs[i] = m_fundamental_freq * m_partial_po_ratios[i];
         }
     }
     else
     {
 #define OLD_QUANTIZED_PARTIALS 1
 #ifdef OLD_QUANTIZED_PARTIALS
+        float pseudoOctaveRatio = std::pow(2.0, (m_pseudo_octave / 1200.0));
         int iter = 1;
         int numpartials = 1;
         m_partial_freqs[0] = m_fundamental_freq;
@@ -617,9 +836,14 @@ void AdditiveVoice::updateState()
     }
     float minf = std::numeric_limits<float>::max();
     float maxf = std::numeric_limits<float>::min();
+    const CompactMorphTable *ratiostable = getFreqRatiosTable();
     for (int i = 0; i < m_num_partials; ++i)
     {
-        float targetratio = m_partial_freq_tweak_ratios[m_freq_tweaks_mode][i];
+        float targetratio = 1.0f;
+        if (ratiostable)
+            targetratio = ratiostable->getFreqRatio(i);
+        else if (m_freq_tweaks_mode < (int)m_partial_freq_tweak_ratios.size())
+            targetratio = m_partial_freq_tweak_ratios[m_freq_tweaks_mode][i];
         float tweakratio =
             xenakios::mapvalue<float>(m_freq_tweaks_mix_mod, 0.0f, 1.0f, 1.0f, targetratio);
         float pf = m_partial_freqs[i] * tweakratio;
@@ -631,13 +855,9 @@ void AdditiveVoice::updateState()
             phaseinc = std::fmod(phaseinc, M_PI * 2);
         m_partial_freqs[i] = pf;
         m_partial_phaseincs[i] = phaseinc;
-        m_partial_freqs_vis[i] = pf;
         float sfgain = m_shared_data->getSafetyFilterCoefficient(pf);
         assert(sfgain >= 0.0f && sfgain <= 1.0f);
         m_partial_safetyfiltergains[i] = sfgain;
-        sfgain = getShapingFilterGain(pf);
-        assert(sfgain >= 0.0f && sfgain <= 1.0f);
-        m_partial_shapingfiltergains[i] = sfgain;
         minf = std::min(minf, pf);
         maxf = std::max(maxf, pf);
 
@@ -652,6 +872,7 @@ void AdditiveVoice::updateState()
 void AdditiveVoice::beginNote(int port_index, int channel, int key, int noteid, double velo)
 {
     state_update_counter = 0;
+    invalidateState();
     m_cur_midi_note = key;
     m_note_id = noteid;
     m_note_channel = channel;
@@ -661,17 +882,139 @@ void AdditiveVoice::beginNote(int port_index, int channel, int key, int noteid,
     m_eg_gate = true;
     m_burst_gen->begin();
     m_is_available = false;
-    m_eg0->attackFrom(0.0f, 0.0f, 0, true);
-    m_eg1->attackFrom(0.0f, 0.0f, 0, true);
+    m_block_peak = 0.0f;
+    m_silent_blocks = 0;
+    m_mod_dest_start_invalid = true;
+    m_note_mods = ParamModulation{};
+    m_amp_env_finished = false;
+    updateEnvelopeParameters();
+    m_shared_data->m_amp_envs.attack(m_slot);
+    m_shared_data->m_mod_envs.attack(m_slot);
+    m_partial_envs.noteOn();
     m_pitch_bend_smoother.reset();
 
     for (int i = 0; i < maxnumpartials; ++i)
     {
         m_partial_phases[i] = 0.0;
     }
+    resetUnisonPhases();
+}
+
+void AdditiveVoice::resetUnisonPhases()
+{
+    // the copies start with spread out phases, so that they don't all peak together at the start
+    for (int i = 0; i < maxnumpartials; ++i)
+        for (int u = 0; u < maxunison; ++u)
+            m_unison_phases[i * maxunison + u] =
+                std::fmod(m_partial_phases[i] + u * 2.39996f, (float)(M_PI * 2));
+}
+
+void AdditiveVoice::setUnison(int count, float detunecents, float spread)
+{
+    count = std::clamp(count, 1, maxunison);
+    if (count == m_unison_count && detunecents == m_unison_detune && spread == m_unison_spread)
+        return;
+    if (count > 1 && m_unison_count == 1)
+        resetUnisonPhases();
+    else if (count == 1 && m_unison_count > 1)
+    {
+        // continue from the first copy
+        for (int i = 0; i < maxnumpartials; ++i)
+            m_partial_phases[i] = m_unison_phases[i * maxunison];
+    }
+    m_unison_count = count;
+    m_unison_detune = detunecents;
+    m_unison_spread = spread;
+    m_unison_gain = 1.0f / std::sqrt((float)count);
+    const int pantablesize = m_shared_data->m_tables->pan_coefficients[0].size();
+    for (int u = 0; u < maxunison; ++u)
+    {
+        // -1 to 1 over the copies
+        float pos = count > 1 ? 2.0f * u / (count - 1) - 1.0f : 0.0f;
+        m_unison_ratios[u] = std::pow(2.0f, pos * detunecents / 1200.0f);
+        m_unison_pan_offsets[u] = (int)(pos * 0.5f * spread * (pantablesize - 1));
+    }
 }
 
-void AdditiveVoice::setSampleRate(float hz) { m_sr = hz; }
+void AdditiveVoice::setBandwidth(float amount, float tilt, float cutoffhz)
+{
+    if (amount == m_bandwidth && tilt == m_bandwidth_tilt && cutoffhz == m_bandwidth_cutoff)
+        return;
+    m_bandwidth = std::clamp(amount, 0.0f, 1.0f);
+    m_bandwidth_tilt = tilt;
+    m_bandwidth_cutoff = cutoffhz;
+    m_noise_bank.setFilterCutoff(cutoffhz, m_sr);
+    for (int i = 0; i < maxnumpartials; ++i)
+    {
+        float pos = 2.0f * i / (maxnumpartials - 1) - 1.0f;
+        m_partial_bandwidths[i] = std::clamp(m_bandwidth * (1.0f + tilt * pos), 0.0f, 1.0f);
+    }
+    // forces the lanes to be set up again with the new bandwidths
+    m_noise_lanes_unison = 0;
+}
+
+void AdditiveVoice::updateNoiseLanes()
+{
+    const int numunison = m_unison_count;
+    const int numlanes = m_num_active_partials * numunison;
+    const int numlanes_padded = (numlanes + 3) & ~3;
+    // the lanes each oscillator was in, so that the filter states can move with the oscillators
+    // when the culling changes the active partials
+    std::array<int, maxnumpartials * maxunison> oldlanes;
+    oldlanes.fill(-1);
+    for (int k = 0; k < numnoiselanes; ++k)
+        if (m_noise_lane_oscs[k] >= 0)
+            oldlanes[m_noise_lane_oscs[k]] = k;
+    std::array<int, numnoiselanes> sources;
+    for (int k = 0; k < m_num_active_partials; ++k)
+    {
+        int partial = m_active_partial_indices[k];
+        float bw = m_partial_bandwidths[partial];
+        for (int u = 0; u < numunison; ++u)
+        {
+            int lane = k * numunison + u;
+            int osc = partial * maxunison + u;
+            sources[lane] = oldlanes[osc];
+            m_noise_lane_oscs[lane] = osc;
+            m_noise_bank.setLaneBandwidth(lane, bw);
+        }
+    }
+    for (int k = numlanes; k < numnoiselanes; ++k)
+    {
+        sources[k] = -1;
+        m_noise_lane_oscs[k] = -1;
+    }
+    for (int k = numlanes; k < numlanes_padded; ++k)
+        m_noise_bank.setLaneBandwidth(k, 0.0f);
+    m_noise_bank.remapLanes(sources.data(), numlanes_padded);
+    m_noise_lanes_unison = numunison;
+}
+
+void AdditiveVoice::updateEnvelopeParameters()
+{
+    const auto &p0 = m_eg0_params;
+    const auto &p1 = m_eg1_params;
+    m_shared_data->m_amp_envs.setParameters(m_slot, p0.a, p0.d, p0.s, p0.r);
+    m_shared_data->m_mod_envs.setParameters(m_slot, p1.a, p1.d, p1.s, p1.r);
+}
+
+void AdditiveVoice::beginNoteAfterFade(int port_index, int channel, int key, int noteid,
+                                       double velo)
+{
+    // if the voice was already fading out for another note, that note is just replaced
+    if (!m_pending_note.active)
+        m_steal_fade_pos = 0;
+    m_pending_note = {true, false, port_index, channel, key, noteid, velo};
+}
+
+void AdditiveVoice::setSampleRate(float hz)
+{
+    m_sr = hz;
+    if (m_burst_gen)
+        m_burst_gen->setSampleRate(hz);
+    m_noise_bank.setFilterCutoff(m_bandwidth_cutoff, m_sr);
+    invalidateState();
+}
 
 void AdditiveVoice::setNumPartials(int n)
 {
@@ -685,127 +1028,311 @@ void AdditiveVoice::setNumPartials(int n)
 void AdditiveVoice::setSharedData(AdditiveSharedData *d)
 {
     m_shared_data = d;
-    for (int i = 0; i < 4; ++i)
-        surge_lfo[i].emplace(&d->sst_provider);
     m_burst_gen.emplace(&d->sst_provider);
-    m_eg0.emplace(&d->sst_provider);
-    m_eg1.emplace(&d->sst_provider);
+    m_burst_gen->setSampleRate(m_sr);
+}
+
+void AdditiveVoice::updateActivePartials(int frame0, int frame1,
+                                         const CompactMorphTable *loadedtable)
+{
+    // the morph position can move a bit during the control block, so look at the neighbouring
+    // frames too
+    int numframes = loadedtable ? loadedtable->getNumFrames() : AdditiveSharedData::maxampframes;
+    frame0 = std::max(frame0 - 1, 0);
+    frame1 = std::min(frame1 + 1, numframes);
+    const float threshold = m_shared_data->m_partial_cull_gain;
+    const auto &morphtable = m_shared_data->partialsmorphtable;
+    // all 1 when the partial envelopes are not used
+    const float *partialenvmax = m_partial_envs.getBlockMaxLevels();
+    int numactive = 0;
+    for (int i = 0; i < m_num_partials; ++i)
+    {
+        float maxgain = 0.0f;
+        if (loadedtable)
+            maxgain = loadedtable->getMaxGain(frame0, frame1, i);
+        else
+            for (int j = frame0; j <= frame1; ++j)
+                maxgain = std::max(maxgain, morphtable[j][i]);
+        maxgain *= m_partial_shapingfiltergains[i] * m_partial_safetyfiltergains[i] *
+                   partialenvmax[i];
+        float &smoothed = m_partial_vol_smoothing_history[i];
+        // partials still fading out with the gain smoothing are kept, so they don't cut off
+        if (maxgain > threshold || smoothed > threshold)
+        {
+            m_active_partial_indices[numactive] = i;
+            ++numactive;
+        }
+        else
+        {
+            // not rendered during this control block, so advance the phase and the gain
+            // smoothing analytically to where they would be at the end of the block. the
+            // partial can then come back later without discontinuities
+            float phase = m_partial_phases[i] + m_partial_phaseincs[i] * SRProvider::BLOCK_SIZE;
+            m_partial_phases[i] = std::fmod(phase, (float)(M_PI * 2));
+            if (m_unison_count > 1)
+            {
+                for (int u = 0; u < m_unison_count; ++u)
+                {
+                    float &uphase = m_unison_phases[i * maxunison + u];
+                    uphase += m_partial_phaseincs[i] * m_unison_ratios[u] * SRProvider::BLOCK_SIZE;
+                    uphase = std::fmod(uphase, (float)(M_PI * 2));
+                }
+            }
+            smoothed = maxgain + m_gain_smoothing_block_coeff * (smoothed - maxgain);
+        }
+    }
+    m_num_active_partials = numactive;
+    // pad the active list to the SIMD width with a valid partial, the results are not used
+    for (int k = numactive; k < ((numactive + 3) & ~3); ++k)
+        m_active_partial_indices[k] = 0;
+}
+
+void AdditiveVoice::publishVisSnapshot()
+{
+    auto &snap = m_vis_buffer.getWriteBuffer();
+    snap.active = !m_is_available;
+    snap.numpartials = m_num_partials;
+    snap.lowestfreq = m_cur_lowest_freq;
+    snap.highestfreq = m_cur_highest_freq;
+    snap.envelopegain = m_shared_data->m_amp_envs.getLevel(m_slot) *
+                        xenakios::decibelsToGain(m_volume_lfo_mod);
+    float ampmorph = m_partials_bal + getParamModulation(&ParamModulation::partials_balance) +
+                     m_mod_dest_end[AdditiveSharedData::MOT_PARTVOLS_MORPH] * 0.5f;
+    snap.ampmorph = std::clamp(ampmorph, 0.0f, 1.0f);
+    for (int i = 0; i < m_num_partials; ++i)
+    {
+        float pf = m_partial_freqs[i];
+        snap.freqs[i] = pf;
+        // the partials outside the frequency limits are not rendered
+        bool audible = pf >= AdditiveSharedData::minpartialfrequency &&
+                       pf < AdditiveSharedData::maxpartialfrequency;
+        snap.amplitudes[i] = audible ? m_partial_vol_smoothing_history[i] : 0.0f;
+        snap.pans[i] = m_partial_pan_smoothing_history[i];
+    }
+    m_vis_buffer.publish();
+}
+
+void AdditiveVoice::checkVoiceFinished()
+{
+    ++m_activity_counter;
+    m_last_block_peak = m_block_peak;
+    int visinterval =
+        std::max(1, (int)(m_sr / SRProvider::BLOCK_SIZE / m_shared_data->m_vis_publish_hz));
+    if (++m_vis_blocks_counter >= visinterval)
+    {
+        m_vis_blocks_counter = 0;
+        publishVisSnapshot();
+    }
+    // the voice is going to be reused for the pending note
+    if (m_pending_note.active)
+    {
+        m_block_peak = 0.0f;
+        return;
+    }
+    // deactivate voice when ADSR finished
+    if (m_amp_env_finished)
+    {
+        m_is_available = true;
+        // so the GUI doesn't keep showing the voice
+        publishVisSnapshot();
+        return;
+    }
+    // the release can go on for a long time at levels that can't be heard anymore
+    if (!m_eg_gate && m_block_peak < m_shared_data->m_voice_silence_gain)
+    {
+        ++m_silent_blocks;
+        if (m_silent_blocks >= AdditiveSharedData::voice_silence_blocks)
+        {
+            m_is_available = true;
+            publishVisSnapshot();
+        }
+    }
+    else
+        m_silent_blocks = 0;
+    m_block_peak = 0.0f;
+}
+
+void AdditiveVoice::evaluateModulation()
+{
+    // the sources at the end of the control block
+    constexpr int last = SRProvider::BLOCK_SIZE - 1;
+    alignas(32) float modulator_outs[AdditiveSharedData::MOS_LAST];
+    for (int i = 0; i < 4; ++i)
+    {
+        modulator_outs[i] = m_shared_data->m_lfo_bank.getOutput(m_slot, i);
+        if (modulator_unipolar[i])
+            modulator_outs[i] = 1.0f + modulator_outs[i];
+    }
+    modulator_outs[AdditiveSharedData::MOS_EG0] =
+        m_shared_data->m_amp_envs.getLevel(m_slot) - m_adsr_sustain_level;
+    modulator_outs[AdditiveSharedData::MOS_EG1] = m_shared_data->m_mod_envs.getLevel(m_slot);
+    modulator_outs[AdditiveSharedData::MOS_BURST] = m_burst_gen->getOutput(last);
+    modulator_outs[AdditiveSharedData::MOS_POLYAT] = m_after_touch_amount * 2.0f;
+    for (int i = 0; i < 4; ++i)
+        modulator_outs[AdditiveSharedData::MOS_CC_A + i] =
+            m_cc_smoothers[i].process(m_cc_vals[i]) * 2.0f;
+
+    m_mod_dest_start = m_mod_dest_end;
+    m_mod_dest_end.fill(0.0f);
+    // only the non-zero routings
+    const auto &matrix = m_shared_data->getModMatrix();
+    for (int i = 0; i < matrix.numroutings; ++i)
+    {
+        const auto &r = matrix.routings[i];
+        float modout = modulator_outs[r.source];
+        assert((!std::isnan(modout)) && modout >= -100.0f && modout <= 100.0f);
+        m_mod_dest_end[r.target] += modout * r.depth;
+    }
+    // at the start of the note there's no previous block to ramp from
+    if (m_mod_dest_start_invalid)
+    {
+        m_mod_dest_start = m_mod_dest_end;
+        m_mod_dest_start_invalid = false;
+    }
 }
 
 #pragma float_control(precise, off, push)
 
 void AdditiveVoice::process(choc::buffer::ChannelArrayView<float> destBuf)
 {
-    static const int shapetranslate[7] = {0, 1, 3, 4, 5, 6, 7};
     const int voicestepgranul = 64;
-    alignas(16) const int numpartslocal = m_num_partials;
-    alignas(32) float partial_outputs[maxnumpartials + 4];
+    alignas(16) float partial_outputs[maxnumpartials * maxunison + 4];
     alignas(16) float outputs[2] = {0.0f, 0.0f};
     alignas(32) float lfo_destinations[AdditiveSharedData::MOT_LAST];
-    alignas(32) float modulator_outs[AdditiveSharedData::MOS_LAST];
+    // the voice may be finished from an earlier section of the synth's block
+    if (m_is_available)
+        return;
+    const auto &ampenvs = m_shared_data->m_amp_envs;
+    const int envblockpos = m_shared_data->m_env_block_pos;
     int nframes = destBuf.getNumFrames();
     for (int outbufpos = 0; outbufpos < nframes; ++outbufpos)
     {
-        for (int i = 0; i < AdditiveSharedData::MOT_LAST; ++i)
-            lfo_destinations[i] = 0.0f;
-        if (state_update_counter == 0)
-        {
-            m_eg0->processBlock(m_eg0_params.a, m_eg0_params.d, m_eg0_params.s, m_eg0_params.r, 1,
-                                1, 1, m_eg_gate);
-            m_eg1->processBlock(m_eg1_params.a, m_eg1_params.d, m_eg1_params.s, m_eg1_params.r, 1,
-                                1, 1, m_eg_gate);
-            // The SST LFO for some reason has a separate type for downward ramp
-            // but we don't need that since the modulation can be applied negatively.
-            // So we map our choice parameter with 7 shapes to the 8 shapes of the SST LFO
-            // by skipping the downward ramp shape
-
-            for (int i = 0; i < 4; ++i)
-            {
-                int translated = shapetranslate[m_lfo_types[i]];
-                surge_lfo[i]->process_block(m_lfo_rates[i], m_lfo_deforms[i], translated, false);
-            }
-        }
-
-        for (int i = 0; i < 4; ++i)
+        if (m_pending_note.active && m_steal_fade_pos >= steal_fade_len)
         {
-            modulator_outs[i] = surge_lfo[i]->outputBlock[state_update_counter];
-            if (modulator_unipolar[i])
-                modulator_outs[i] = 1.0f + modulator_outs[i];
+            auto pn = m_pending_note;
+            m_pending_note.active = false;
+            beginNote(pn.port, pn.channel, pn.key, pn.noteid, pn.velo);
+            if (pn.released)
+                endNote();
         }
-
-        float envgain = m_eg0->outputCache[state_update_counter];
-        modulator_outs[AdditiveSharedData::MOS_EG0] = envgain - m_adsr_sustain_level;
-        float auxegval = m_eg1->outputCache[state_update_counter];
-        modulator_outs[AdditiveSharedData::MOS_EG1] = auxegval;
-        float burst_eg = 0.0; // m_burst_gen->process();
-        modulator_outs[AdditiveSharedData::MOS_BURST] = burst_eg;
-        modulator_outs[AdditiveSharedData::MOS_POLYAT] = m_after_touch_amount * 2.0f;
-        for (int i = 0; i < 4; ++i)
-            modulator_outs[AdditiveSharedData::MOS_CC_A + i] =
-                m_cc_smoothers[i].process(m_cc_vals[i]) * 2.0f;
-        alignas(32) float lfo_destinations[AdditiveSharedData::MOT_LAST] = {0.0f, 0.0f, 0.0f, 0.0f,
-                                                                            0.0f, 0.0f, 0.0f};
-        for (int i = 0; i < AdditiveSharedData::MOS_LAST; ++i) // sources
+        if (state_update_counter == 0)
         {
-            float modout = modulator_outs[i];
-            assert((!std::isnan(modout)) && modout >= -100.0f && modout <= 100.0f);
-            for (int j = 0; j < AdditiveSharedData::MOT_LAST; ++j) // destinations
-            {
-                lfo_destinations[j] += modout * m_shared_data->modmatrix[i][j];
-            }
+            updateEnvelopeParameters();
+            m_burst_gen->processBlock();
         }
 
-        m_pitch_lfo_mod = lfo_destinations[AdditiveSharedData::MOT_PITCH] * 12.0;
-
-        m_freq_tweaks_mix_mod =
-            m_freq_tweaks_mix + lfo_destinations[AdditiveSharedData::MOT_PARTREMAPMORPH] * 0.5f;
-
-        m_freq_tweaks_mix_mod = xenakios::jlimit(0.0f, 1.0f, m_freq_tweaks_mix_mod);
-        // if (m_freq_tweaks_mode!=3)
-        //     m_freq_tweaks_mix_mod = 1.0-std::pow(1.0-m_freq_tweaks_mix_mod,2.0f);
-
-        m_filter_morph_mod =
-            m_filter_morph + lfo_destinations[AdditiveSharedData::MOT_FILTERMORPH] * 0.5f;
-        m_filter_morph_mod = xenakios::jlimit(0.0f, 1.0f, m_filter_morph_mod);
-
-        m_volume_lfo_mod = 24.0 * lfo_destinations[AdditiveSharedData::MOT_VOLUME];
-        m_volume_lfo_mod = std::clamp(m_volume_lfo_mod + m_base_volume, -96.0f, 0.0f);
-        float volmodgain = xenakios::decibelsToGain(m_volume_lfo_mod);
+        float envgain = ampenvs.getOutput(m_slot, envblockpos + outbufpos);
         if (state_update_counter == 0)
         {
+            evaluateModulation();
+            // the targets only used by updateState don't need interpolation
+            const auto &moddest = m_mod_dest_end;
+            m_pitch_lfo_mod = moddest[AdditiveSharedData::MOT_PITCH] * 12.0;
+
+            m_freq_tweaks_mix_mod = m_freq_tweaks_mix +
+                                    getParamModulation(&ParamModulation::tweaks_mix) +
+                                    moddest[AdditiveSharedData::MOT_PARTREMAPMORPH] * 0.5f;
+
+            m_freq_tweaks_mix_mod = xenakios::jlimit(0.0f, 1.0f, m_freq_tweaks_mix_mod);
+            // if (m_freq_tweaks_mode!=3)
+            //     m_freq_tweaks_mix_mod = 1.0-std::pow(1.0-m_freq_tweaks_mix_mod,2.0f);
+
+            m_filter_morph_mod = m_filter_morph +
+                                 getParamModulation(&ParamModulation::filter_morph) +
+                                 moddest[AdditiveSharedData::MOT_FILTERMORPH] * 0.5f;
+            m_filter_morph_mod = xenakios::jlimit(0.0f, 1.0f, m_filter_morph_mod);
             // let's see how this goes...
             updateState();
+            m_partial_envs.setParameters(m_partial_env_params, m_sr / SRProvider::BLOCK_SIZE);
+            m_partial_envs.process(m_num_partials);
         }
+        // the audio rate targets are ramped from the end of the previous control block to the
+        // end of this one
+        const float modfrac = (state_update_counter + 1) * (1.0f / SRProvider::BLOCK_SIZE);
+        for (int i = 0; i < AdditiveSharedData::MOT_LAST; ++i)
+            lfo_destinations[i] =
+                m_mod_dest_start[i] + (m_mod_dest_end[i] - m_mod_dest_start[i]) * modfrac;
 
-        // calculate SIMD sines with SSE
-        float phaseslocal[64];
-        for (int i = 0; i < 64; ++i)
-            phaseslocal[i] = m_partial_phases[i];
-        for (alignas(16) int i = 0; i < numpartslocal; i += 4)
-        {
-
-            alignas(32) __m128 temp = _mm_loadu_ps(&phaseslocal[i]);
-            temp = sse_mathfun_sin_ps(temp);
-            _mm_storeu_ps(&partial_outputs[i], temp);
-        }
+        m_volume_lfo_mod = 24.0 * lfo_destinations[AdditiveSharedData::MOT_VOLUME];
+        m_volume_lfo_mod =
+            std::clamp(m_volume_lfo_mod + m_base_volume + getParamModulation(&ParamModulation::volume),
+                       -96.0f, 0.0f);
+        float volmodgain = xenakios::decibelsToGain(m_volume_lfo_mod);
+        float burst_eg = m_burst_gen->getOutput(state_update_counter);
 
-        float amp_morph =
-            m_partials_bal + lfo_destinations[AdditiveSharedData::MOT_PARTVOLS_MORPH] * 0.5f;
+        float amp_morph = m_partials_bal + getParamModulation(&ParamModulation::partials_balance) +
+                          lfo_destinations[AdditiveSharedData::MOT_PARTVOLS_MORPH] * 0.5f;
         amp_morph = xenakios::jlimit<float>(0.0f, 1.0f, amp_morph);
-        m_amp_morph_vis = amp_morph;
-        amp_morph = amp_morph * (AdditiveSharedData::maxampframes - 1);
+        const CompactMorphTable *loadedtable = m_shared_data->getLoadedMorphTableInUse();
+        int numampframes =
+            loadedtable ? loadedtable->getNumFrames() : AdditiveSharedData::maxampframes;
+        amp_morph = amp_morph * (numampframes - 1);
         int amp_morph_i0 = amp_morph;
         int amp_morph_i1 = amp_morph_i0 + 1;
         float amp_morph_frac = amp_morph - amp_morph_i0;
 
-        float pan_morph =
-            m_partials_pan_morph + lfo_destinations[AdditiveSharedData::MOT_PARTPANS_MORPH] * 0.5f;
+        float pan_morph = m_partials_pan_morph +
+                          getParamModulation(&ParamModulation::partials_pan_morph) +
+                          lfo_destinations[AdditiveSharedData::MOT_PARTPANS_MORPH] * 0.5f;
+        const float voicepan =
+            std::clamp(m_pan + getParamModulation(&ParamModulation::pan), 0.0f, 1.0f);
         pan_morph = xenakios::jlimit<float>(0.0f, 1.0f, pan_morph);
         pan_morph = pan_morph * (AdditiveSharedData::maxpanframes - 1);
         int pan_morph_i0 = pan_morph;
         int pan_morph_i1 = pan_morph_i0 + 1;
         float pan_morph_frac = pan_morph - pan_morph_i0;
 
+        if (state_update_counter == 0)
+            updateActivePartials(amp_morph_i0, amp_morph_i1, loadedtable);
+        // the loaded tables are interpolated for all partials at once straight from the
+        // 16 bit data
+        if (loadedtable && (state_update_counter == 0 ||
+                            loadedtable->getSerial() != m_loaded_table_gains_serial))
+        {
+            loadedtable->getInterpolatedGains(amp_morph_i0, amp_morph_frac, m_num_partials,
+                                              m_loaded_table_gains.data());
+            m_loaded_table_gains_serial = loadedtable->getSerial();
+        }
+        const int numactive = m_num_active_partials;
+
+        // calculate SIMD sines with SSE, only for the partials that are going to be heard,
+        // packed densely so that no SIMD lanes are wasted. the unison copies of a partial are
+        // next to each other, so they are just more lanes
+        const int numunison = m_unison_count;
+        const int numlanes = numactive * numunison;
+        const int numlanes_padded = (numlanes + 3) & ~3;
+        alignas(16) float phaseslocal[maxnumpartials * maxunison + 4];
+        if (numunison == 1)
+        {
+            for (int k = 0; k < numlanes_padded; ++k)
+                phaseslocal[k] = m_partial_phases[m_active_partial_indices[k]];
+        }
+        else
+        {
+            for (int k = 0; k < numactive; ++k)
+            {
+                const float *src = &m_unison_phases[m_active_partial_indices[k] * maxunison];
+                for (int u = 0; u < numunison; ++u)
+                    phaseslocal[k * numunison + u] = src[u];
+            }
+            for (int k = numlanes; k < numlanes_padded; ++k)
+                phaseslocal[k] = 0.0f;
+        }
+        for (int k = 0; k < numlanes_padded; k += 4)
+        {
+            __m128 temp = _mm_load_ps(&phaseslocal[k]);
+            temp = sse_mathfun_sin_ps(temp);
+            _mm_store_ps(&partial_outputs[k], temp);
+        }
+        // the noise modulation costs about as much as the sines, so nothing is done for it
+        // unless it is in use
+        if (m_bandwidth > 0.0f)
+        {
+            if (state_update_counter == 0 || numunison != m_noise_lanes_unison)
+                updateNoiseLanes();
+            m_noise_bank.process(partial_outputs, numlanes_padded);
+        }
+
         // sum sines and advance phases
         // might be possible to do this as SIMD too, but won't bother for now
         float p0freq = m_partial_freqs[0];
@@ -814,18 +1341,27 @@ void AdditiveVoice::process(choc::buffer::ChannelArrayView<float> destBuf)
         minatten = minatten * minatten;
         outputs[0] = 0.0f;
         outputs[1] = 0.0f;
-        for (int i = 0; i < numpartslocal; ++i)
+        const float *partialenvs = m_partial_envs.getLevels();
+        for (int k = 0; k < numactive; ++k)
         {
+            const int i = m_active_partial_indices[k];
             // partials may sometimes go beyond reasonable limits, so only sum the ones within
             // frequency limits
             float pfreq = m_partial_freqs[i];
             if (pfreq >= AdditiveSharedData::minpartialfrequency &&
                 pfreq < AdditiveSharedData::maxpartialfrequency)
             {
-                float gain0 = m_shared_data->partialsmorphtable[amp_morph_i0][i];
-                float gain1 = m_shared_data->partialsmorphtable[amp_morph_i1][i];
                 // main partial frequency morphing
-                float interp_gain = gain0 + (gain1 - gain0) * amp_morph_frac;
+                float interp_gain;
+                if (loadedtable)
+                    interp_gain = m_loaded_table_gains[i];
+                else
+                {
+                    float gain0 = m_shared_data->partialsmorphtable[amp_morph_i0][i];
+                    float gain1 = m_shared_data->partialsmorphtable[amp_morph_i1][i];
+                    interp_gain = gain0 + (gain1 - gain0) * amp_morph_frac;
+                }
+                interp_gain *= partialenvs[i];
                 // creative filter
                 interp_gain *= m_partial_shapingfiltergains[i];
                 // extreme low and high frequency cutoffs
@@ -836,13 +1372,11 @@ void AdditiveVoice::process(choc::buffer::ChannelArrayView<float> destBuf)
                 interp_gain = smoothed;
                 old = smoothed;
 
-                m_partial_amplitudes[i] = interp_gain; // for visualization
-
                 float pan0 = m_shared_data->partialspanmorphtable[pan_morph_i0][i];
                 float pan1 = m_shared_data->partialspanmorphtable[pan_morph_i1][i];
                 float interp_pan = pan0 + (pan1 - pan0) * pan_morph_frac;
                 interp_pan -= 0.5f;  // is now -0.5 to 0.5
-                interp_pan += m_pan; // if voice pan at 0.5, back to 0.0 to 1.0
+                interp_pan += voicepan; // if voice pan at 0.5, back to 0.0 to 1.0
                 // however, if voice pan is at say 0.75, adding 0.5 would make 1.25 which we
                 // can't handle so reflect back inside the 0 to 1 range this could have at least
                 // 3 modes : clamp, reflect and wrap which we might make a parameter/option
@@ -857,35 +1391,60 @@ void AdditiveVoice::process(choc::buffer::ChannelArrayView<float> destBuf)
                 smoothed = interp_pan + m_pan_smoothing_coeff * (oldpan - interp_pan);
                 oldpan = smoothed;
                 interp_pan = smoothed;
-                m_partial_pans[i] = interp_pan; // for visualization
-                int panCoeffIndex = (m_shared_data->pan_coefficients[0].size() - 1) * interp_pan;
+                const auto &pancoeffs = m_shared_data->m_tables->pan_coefficients;
+                int panCoeffIndex = (pancoeffs[0].size() - 1) * interp_pan;
                 // we both jassert and clamp, so we can catch in debug builds
-                assert(panCoeffIndex >= 0 &&
-                       panCoeffIndex < m_shared_data->pan_coefficients[0].size());
+                assert(panCoeffIndex >= 0 && panCoeffIndex < pancoeffs[0].size());
                 // panCoeffIndex =
-                // xenakios::jlimit<int>(0,(int)m_shared_data->pan_coefficients[0].size()-1,panCoeffIndex);
+                // xenakios::jlimit<int>(0,(int)pancoeffs[0].size()-1,panCoeffIndex);
 
-                float leftGain = m_shared_data->pan_coefficients[0][panCoeffIndex];
-                float rightGain = m_shared_data->pan_coefficients[1][panCoeffIndex];
-                float po = partial_outputs[i] * interp_gain;
-                outputs[1] += po * rightGain;
-                outputs[0] += po * leftGain;
+                if (numunison == 1)
+                {
+                    float leftGain = pancoeffs[0][panCoeffIndex];
+                    float rightGain = pancoeffs[1][panCoeffIndex];
+                    float po = partial_outputs[k] * interp_gain;
+                    outputs[1] += po * rightGain;
+                    outputs[0] += po * leftGain;
+                }
+                else
+                {
+                    // the gain and pan calculated above are shared by the copies, which are
+                    // just spread around the pan position
+                    const float *po = &partial_outputs[k * numunison];
+                    for (int u = 0; u < numunison; ++u)
+                    {
+                        int idx = std::clamp(panCoeffIndex + m_unison_pan_offsets[u], 0,
+                                             (int)pancoeffs[0].size() - 1);
+                        float g = po[u] * interp_gain * m_unison_gain;
+                        outputs[0] += g * pancoeffs[0][idx];
+                        outputs[1] += g * pancoeffs[1][idx];
+                    }
+                }
             }
-            else
-                m_partial_amplitudes[i] = 0.0f; // for visualization
 
-            float phase = m_partial_phases[i];
-            phase += m_partial_phaseincs[i];
-            if (phase >= M_PI * 2)
-                phase -= M_PI * 2;
-            m_partial_phases[i] = phase;
+            if (numunison == 1)
+            {
+                float phase = m_partial_phases[i];
+                phase += m_partial_phaseincs[i];
+                if (phase >= M_PI * 2)
+                    phase -= M_PI * 2;
+                m_partial_phases[i] = phase;
+            }
+            else
+            {
+                float *phases = &m_unison_phases[i * maxunison];
+                for (int u = 0; u < numunison; ++u)
+                {
+                    float phase = phases[u] + m_partial_phaseincs[i] * m_unison_ratios[u];
+                    if (phase >= M_PI * 2)
+                        phase -= M_PI * 2;
+                    phases[u] = phase;
+                }
+            }
         }
 
-        m_adsr_burst_mix = 0.0f;
         float finalgain = (1.0 - m_adsr_burst_mix) * envgain + m_adsr_burst_mix * burst_eg;
         finalgain *= volmodgain;
-        // might want to visualize velocity too, but let's not, for now
-        m_adsr_vis_amp = finalgain;
         // output_frame[0] = output*envgain*m_cur_velo*m_pan;
         // output_frame[1] = output*envgain*m_cur_velo*(1.0-m_pan);
         // float send_gain = m_aux_send_a + lfo_destinations[AdditiveSharedData::MOT_AUX_SEND_A];
@@ -893,69 +1452,298 @@ void AdditiveVoice::process(choc::buffer::ChannelArrayView<float> destBuf)
         // send_gain = -48.0f + 48.0f * send_gain;
         // send_gain = xenakios::decibelsToGain(send_gain);
 
-        destBuf.getSample(0, outbufpos) +=
-            outputs[0] * m_cur_velo_gain * finalgain * m_partial_gain_compen;
-        destBuf.getSample(1, outbufpos) +=
-            outputs[1] * m_cur_velo_gain * finalgain * m_partial_gain_compen;
+        float outgain = m_cur_velo_gain * finalgain * m_partial_gain_compen;
+        if (m_pending_note.active)
+        {
+            outgain *= 1.0f - (float)m_steal_fade_pos / steal_fade_len;
+            ++m_steal_fade_pos;
+        }
+        float outl = outputs[0] * outgain;
+        float outr = outputs[1] * outgain;
+        destBuf.getSample(0, outbufpos) += outl;
+        destBuf.getSample(1, outbufpos) += outr;
+        m_block_peak = std::max(m_block_peak, std::max(std::abs(outl), std::abs(outr)));
         // output_frame[0] = outputs[0] * m_cur_velo_gain * finalgain * m_partial_gain_compen;
         // output_frame[1] = outputs[1] * m_cur_velo_gain * finalgain * m_partial_gain_compen;
         // output_frame[2] = output_frame[0] * send_gain;
         // output_frame[3] = output_frame[1] * send_gain;
-        // deactivate voice when ADSR finished
-        if (m_eg0->stage == VoiceEG::s_eoc)
-        {
-            m_is_available = true;
-        }
         ++state_update_counter;
         if (state_update_counter == SRProvider::BLOCK_SIZE)
+        {
             state_update_counter = 0;
+            checkVoiceFinished();
+            // nothing more to render for the rest of the buffer
+            if (m_is_available)
+                break;
+        }
     }
 }
 
 #pragma float_control(pop)
 
-AdditiveSynth::AdditiveSynth() {}
+AdditiveSynth::AdditiveSynth()
+    : m_morph_table_loader(m_worker, [this](std::unique_ptr<CompactMorphTable> table,
+                                            const std::string &error) {
+          // the table is kept in the file format for saving it into the plugin state
+          std::ostringstream os;
+          if (table)
+              writeMorphTable(os, *table);
+          std::lock_guard<std::mutex> locker(m_morph_table_error_mutex);
+          if (table)
+          {
+              m_shared_data.publishLoadedMorphTable(std::move(table));
+              m_morph_table_data = os.str();
+          }
+          else if (error.empty())
+          {
+              // a restored state without a table
+              m_shared_data.publishLoadedMorphTable(nullptr);
+              m_morph_table_data.clear();
+          }
+          m_morph_table_load_error = error;
+      })
+{
+}
+
+void AdditiveSynth::loadMorphTableAsync(std::filesystem::path path)
+{
+    m_morph_table_loader.requestLoad(std::move(path));
+}
+
+AdditiveSynth::PersistentState AdditiveSynth::getPersistentState()
+{
+    m_worker.waitUntilIdle();
+    PersistentState state;
+    auto tuning = m_shared_data.getLatestPublishedTuning();
+    state.scl = tuning.scale.rawText;
+    state.kbm = tuning.keyboardMapping.rawText;
+    state.moddepths = m_shared_data.getModulationDepths();
+    std::lock_guard<std::mutex> locker(m_morph_table_error_mutex);
+    state.morphtable = m_morph_table_data;
+    return state;
+}
+
+void AdditiveSynth::restorePersistentStateAsync(PersistentState state)
+{
+    m_shared_data.setModulationDepths(state.moddepths);
+    importTuningAsync({{}, std::move(state.scl)}, {{}, std::move(state.kbm)});
+    m_morph_table_loader.requestDecode(std::move(state.morphtable));
+}
+
+void AdditiveSynth::importTuningAsync(TuningSource scl, TuningSource kbm)
+{
+    if (scl.empty() && kbm.empty())
+        return;
+    {
+        std::lock_guard<std::mutex> locker(m_tuning_import_mutex);
+        if (!scl.empty())
+            m_pending_scl = std::move(scl);
+        if (!kbm.empty())
+            m_pending_kbm = std::move(kbm);
+    }
+    m_worker.post([this] { runTuningImport(); });
+}
 
-void AdditiveSynth::prepare(double sampleRate, int maxbufsize)
+// worker thread
+void AdditiveSynth::runTuningImport()
+{
+    TuningSource scl;
+    TuningSource kbm;
+    {
+        std::lock_guard<std::mutex> locker(m_tuning_import_mutex);
+        std::swap(scl, m_pending_scl);
+        std::swap(kbm, m_pending_kbm);
+    }
+    // already done by an earlier run
+    if (scl.empty() && kbm.empty())
+        return;
+    std::string error;
+    try
+    {
+        // the parts not imported come from the latest published tuning, so consecutive
+        // imports build on each other
+        auto current = m_shared_data.getLatestPublishedTuning();
+        auto scale = current.scale;
+        if (!scl.file.empty())
+            scale = Tunings::readSCLFile(scl.file.string());
+        else if (!scl.text.empty())
+            scale = Tunings::parseSCLData(scl.text);
+        auto mapping = current.keyboardMapping;
+        if (!kbm.file.empty())
+            mapping = Tunings::readKBMFile(kbm.file.string());
+        else if (!kbm.text.empty())
+            mapping = Tunings::parseKBMData(kbm.text);
+        error = m_shared_data.publishTuning(Tunings::Tuning(scale, mapping));
+    }
+    catch (const std::exception &e)
+    {
+        error = e.what();
+    }
+    if (!error.empty())
+    {
+        auto name = !scl.file.empty() ? scl.file.filename().string()
+                    : !kbm.file.empty() ? kbm.file.filename().string()
+                                        : std::string("tuning text");
+        error = "Could not import " + name + " : " + error;
+    }
+    {
+        std::lock_guard<std::mutex> locker(m_tuning_import_mutex);
+        m_tuning_import_error = error;
+    }
+    ++m_num_finished_tuning_imports;
+}
+
+void AdditiveSynth::prepare(double sampleRate, int maxbufsize, int polyphony)
 {
     m_mixbuf = choc::buffer::ChannelArrayBuffer<float>(2, (unsigned int)maxbufsize);
+    for (auto &s : m_saturators)
+        s.prepare(maxbufsize);
     m_shared_data.sst_provider.setSampleRate(sampleRate);
-    for (auto &e : m_voices)
+    m_shared_data.m_lfo_bank.setSampleRate(sampleRate);
+    m_shared_data.m_amp_envs.setSampleRate(sampleRate);
+    m_shared_data.m_mod_envs.setSampleRate(sampleRate);
+    m_shared_data.m_amp_envs.reset();
+    m_shared_data.m_mod_envs.reset();
+    m_shared_data.m_env_block_pos = 0;
+    polyphony = xenakios::jlimit(1, maxpolyphony, polyphony);
+    m_voice_pool = std::make_unique<AdditiveVoice[]>(polyphony);
+    m_voices = std::span<AdditiveVoice>(m_voice_pool.get(), polyphony);
+    m_active_voices.clear();
+    m_active_voices.reserve(polyphony);
+    m_free_voices.clear();
+    m_free_voices.reserve(polyphony);
+    // push in reverse, so that voices get taken from the free list in pool order
+    for (int i = polyphony - 1; i >= 0; --i)
     {
+        auto &e = m_voices[i];
         e.setSampleRate(sampleRate);
         e.setSharedData(&m_shared_data);
+        e.setSlot(i);
+        m_shared_data.m_lfo_bank.resetVoice(i);
+        m_free_voices.push_back(&e);
+    }
+    m_num_active_voices = 0;
+    m_note_id_voices.clear();
+}
+
+void AdditiveSynth::unindexVoice(AdditiveVoice *v)
+{
+    int channel = 0;
+    int key = 0;
+    int noteid = -1;
+    v->getScheduledNote(channel, key, noteid);
+    m_note_id_voices.erase(noteid, v);
+}
+
+AdditiveVoice *AdditiveSynth::findVoiceToSteal()
+{
+    // released voices first, then the quietest and then the oldest. voices already fading out
+    // for a new note are the last resort, since their note hasn't even started yet
+    auto rank = [](const AdditiveVoice *v) {
+        if (v->isStealFading())
+            return 2;
+        return v->m_eg_gate ? 1 : 0;
+    };
+    AdditiveVoice *result = nullptr;
+    for (auto v : m_active_voices)
+    {
+        if (!result)
+        {
+            result = v;
+            continue;
+        }
+        int r0 = rank(v);
+        int r1 = rank(result);
+        if (r0 != r1)
+        {
+            if (r0 < r1)
+                result = v;
+            continue;
+        }
+        float p0 = v->getLastBlockPeak();
+        float p1 = result->getLastBlockPeak();
+        if (p0 < p1 || (p0 == p1 && v->m_start_time_stamp < result->m_start_time_stamp))
+            result = v;
+    }
+    return result;
+}
+
+void AdditiveSynth::reclaimFinishedVoices()
+{
+    // order of the active voices doesn't matter, so can just swap the finished voice
+    // with the last one
+    for (size_t i = 0; i < m_active_voices.size();)
+    {
+        auto v = m_active_voices[i];
+        if (v->m_is_available)
+        {
+            unindexVoice(v);
+            m_active_voices[i] = m_active_voices.back();
+            m_active_voices.pop_back();
+            m_free_voices.push_back(v);
+        }
+        else
+            ++i;
     }
 }
 
 void AdditiveSynth::processBlock(choc::buffer::ChannelArrayView<float> destBuf)
 {
-    // yes, we know...no locks should be used, but this won't be contested much
-    std::lock_guard<std::mutex> locker(m_cs);
+    // picks up tuning changes made from other threads, never blocks
+    m_shared_data.updateTuning();
+    m_shared_data.updateLoadedMorphTable();
+    m_shared_data.updateModMatrix();
+    // the blocks can be shorter than the control block when they are split at events, so the
+    // external tuning is polled based on the elapsed time
+    if (m_key_tuning_source && m_time_pos_counter >= m_key_tuning_poll_pos)
+    {
+        m_key_tuning_source->pollKeyPitches(m_shared_data.m_external_key_pitches);
+        m_key_tuning_poll_pos = m_time_pos_counter + SRProvider::BLOCK_SIZE;
+    }
     auto mixbufView =
         m_mixbuf.getSection(choc::buffer::ChannelRange{0, 2}, {0, destBuf.getNumFrames()});
     mixbufView.clear();
-    // might want to avoid doing this for voices that are not active or
-    // if parameters have not changed, but this will have to do for now
-    int voicecount = 0;
-    for (auto &v : m_voices)
-    {
-        // v.updateState();
-        if (v.m_is_available == false)
-            ++voicecount;
-    }
-    m_num_active_voices = voicecount;
-    m_mixbuf.clear();
-    for (auto &v : m_voices)
+    m_num_active_voices = (int)m_active_voices.size();
+    // the envelopes of all voices are advanced together, so the voices are rendered in sections
+    // that end at the envelope control block boundaries
+    const int nframes = destBuf.getNumFrames();
+    int pos = 0;
+    while (pos < nframes)
     {
-        if (!v.m_is_available)
+        int &envpos = m_shared_data.m_env_block_pos;
+        if (envpos == 0)
+        {
+            uint64_t finished = m_shared_data.m_amp_envs.process();
+            m_shared_data.m_mod_envs.process();
+            uint64_t lfovoices = 0;
+            for (auto v : m_active_voices)
+            {
+                m_shared_data.m_lfo_bank.setVoiceParams(v->getSlot(), v->m_lfo_params);
+                lfovoices |= uint64_t(1) << v->getSlot();
+            }
+            m_shared_data.m_lfo_bank.process(lfovoices);
+            while (finished != 0)
+            {
+                m_voices[std::countr_zero(finished)].envelopeFinished();
+                finished &= finished - 1;
+            }
+        }
+        int len = std::min(nframes - pos, SRProvider::BLOCK_SIZE - envpos);
+        auto section = mixbufView.getFrameRange({(uint32_t)pos, (uint32_t)(pos + len)});
+        for (auto v : m_active_voices)
         {
-            v.process(mixbufView);
+            v->process(section);
         }
+        envpos = (envpos + len) % SRProvider::BLOCK_SIZE;
+        pos += len;
     }
-    for (int i = 0; i < mixbufView.getNumFrames(); ++i)
+    reclaimFinishedVoices();
+    int osfactor = 1 << m_saturator_quality.load();
+    for (int i = 0; i < 2; ++i)
     {
-        mixbufView.getSample(0, i) = std::tanh(mixbufView.getSample(0, i));
-        mixbufView.getSample(1, i) = std::tanh(mixbufView.getSample(1, i));
+        m_saturators[i].setOversampling(osfactor);
+        m_saturators[i].process(mixbufView.data.channels[i] + mixbufView.data.offset,
+                                mixbufView.getNumFrames());
     }
     choc::buffer::applyGain(mixbufView, 1.0);
     choc::buffer::copy(destBuf, mixbufView);
@@ -964,98 +1752,350 @@ void AdditiveSynth::processBlock(choc::buffer::ChannelArrayView<float> destBuf)
 
 void AdditiveSynth::setPitchBendRange(double range) { m_pitch_bend_range = range; }
 
-void AdditiveSynth::handleParameterValue(int port, int ch, int key, int note_id, clap_id parid,
-                                         double value)
+template <typename F> void AdditiveSynth::forEachVoiceOfKey(int channel, int key, F &&func)
 {
-    for (auto &v : m_voices)
+    for (auto v : m_active_voices)
     {
-        if ((key == -1 || v.m_cur_midi_note == key) && (note_id == -1 || v.m_note_id == note_id) &&
-            (port == -1 || v.m_note_port == port) && (ch == -1 || v.m_note_channel == ch))
-        {
-            if (parid == 0)
-                v.m_filter_morph = value;
-            if (parid == 1)
-                v.setPan(value);
-        }
+        int vchannel = 0;
+        int vkey = 0;
+        int vnoteid = -1;
+        v->getScheduledNote(vchannel, vkey, vnoteid);
+        if ((channel == -1 || vchannel == channel) && vkey == key)
+            func(*v);
     }
 }
 
-void AdditiveSynth::handlePolyAfterTouch(int port_index, int channel, int note, float value)
+template <typename F>
+void AdditiveSynth::forEachTargetVoice(int port, int ch, int key, int note_id, F &&func)
 {
-    // uuf, we have to find the active voices playing the key
+    if (note_id != -1)
+    {
+        if (auto v = m_note_id_voices.find(note_id))
+            func(*v);
+        return;
+    }
+    if (key != -1 && ch != -1)
+    {
+        forEachVoiceOfKey(ch, key, func);
+        return;
+    }
+    // also the voices not playing, so that they start the next note with the value
     for (auto &v : m_voices)
     {
-        if (!v.m_is_available && v.m_cur_midi_note == note)
+        if ((key == -1 || v.m_cur_midi_note == key) && (port == -1 || v.m_note_port == port) &&
+            (ch == -1 || v.m_note_channel == ch))
         {
-            v.m_after_touch_amount = value;
-            // DBG(value);
+            func(v);
         }
     }
 }
 
-void AdditiveSynth::handleNoteOn(int port_index, int channel, int key, int noteid, double velo)
+void AdditiveSynth::applyVoiceParameter(AdditiveVoice &v, ParamIDs parid, double value)
 {
-    bool found = false;
-    auto startnotefunc = [this](AdditiveVoice &v, int port_index, int channel, int key, int noteid,
-                                double velo) {
-        v.beginNote(port_index, channel, key, noteid, velo);
-        v.m_pitch_bend_amount = m_cur_pitch_bend;
-        v.updateState();
-        v.m_start_time_stamp = m_time_pos_counter;
-        // if we want to do something like this, should be a voice on triggered modulator or
-        // something
-        /*
-        if (m_note_counter == 0)
-            v.setPan(0.1);
-        else if (m_note_counter == 1)
-            v.setPan(0.5);
-        else v.setPan(0.9);
-        */
-        ++m_note_counter;
-        if (m_note_counter == 3)
-            m_note_counter = 0;
-    };
-    for (auto &v : m_voices)
+    int ival = (int)std::round(value);
+    auto &bg = *v.m_burst_gen;
+    switch (parid)
     {
-        if (v.m_is_available)
-        {
-            startnotefunc(v, port_index, channel, key, noteid, velo);
-            found = true;
-            break;
-        }
+    case ParamIDs::FilterMorph:
+        v.m_filter_morph = value;
+        break;
+    case ParamIDs::Pan:
+        v.setPan(value);
+        break;
+    case ParamIDs::Volume:
+        v.m_base_volume = value;
+        break;
+    case ParamIDs::NumPartials:
+        v.setNumPartials(ival);
+        break;
+    case ParamIDs::PartialsBalance:
+        v.setPartialsBalance(value);
+        break;
+    case ParamIDs::PartialsPanMorph:
+        v.setPartialsPanMorph(value);
+        break;
+    case ParamIDs::FilterMode:
+        v.m_filter_mode = std::clamp(ival, 0, AdditiveSharedData::num_shaping_filter_modes - 1);
+        break;
+    case ParamIDs::PseudoOctave:
+        v.setPseudoOctave(value);
+        break;
+    case ParamIDs::PartialTuningMode:
+        v.setTuningMode(ival);
+        break;
+    case ParamIDs::PartialEDO:
+        v.setEDO(std::max(ival, 1));
+        break;
+    case ParamIDs::FreqTweaksMode:
+        v.m_freq_tweaks_mode = std::clamp(ival, 0, AdditiveVoice::loaded_table_tweaks_mode);
+        break;
+    case ParamIDs::FreqTweaksMix:
+        v.m_freq_tweaks_mix = value;
+        break;
+    case ParamIDs::VelocityResponse:
+        v.m_vel_respo = value;
+        break;
+    case ParamIDs::EG0Attack:
+        v.m_eg0_params.a = value;
+        break;
+    case ParamIDs::EG0Decay:
+        v.m_eg0_params.d = value;
+        break;
+    case ParamIDs::EG0Sustain:
+        v.m_eg0_params.s = value;
+        // the main envelope modulation output is relative to the sustain level
+        v.m_adsr_sustain_level = value;
+        break;
+    case ParamIDs::EG0Release:
+        v.m_eg0_params.r = value;
+        break;
+    case ParamIDs::EG1Attack:
+        v.m_eg1_params.a = value;
+        break;
+    case ParamIDs::EG1Decay:
+        v.m_eg1_params.d = value;
+        break;
+    case ParamIDs::EG1Sustain:
+        v.m_eg1_params.s = value;
+        break;
+    case ParamIDs::EG1Release:
+        v.m_eg1_params.r = value;
+        break;
+    case ParamIDs::LFO0Rate:
+    case ParamIDs::LFO1Rate:
+    case ParamIDs::LFO2Rate:
+    case ParamIDs::LFO3Rate:
+        v.m_lfo_params.rates[(int)parid - (int)ParamIDs::LFO0Rate] = value;
+        break;
+    case ParamIDs::LFO0Shape:
+    case ParamIDs::LFO1Shape:
+    case ParamIDs::LFO2Shape:
+    case ParamIDs::LFO3Shape:
+    {
+        // the bank has a separate shape for the downward ramp, but we don't need that since the
+        // modulation can be applied negatively. so the 7 shapes of the parameter skip it
+        static const int shapetranslate[7] = {0, 1, 3, 4, 5, 6, 7};
+        v.m_lfo_params.shapes[(int)parid - (int)ParamIDs::LFO0Shape] =
+            shapetranslate[std::clamp(ival, 0, 6)];
+        break;
     }
-    if (!found)
+    case ParamIDs::LFO0Deform:
+    case ParamIDs::LFO1Deform:
+    case ParamIDs::LFO2Deform:
+    case ParamIDs::LFO3Deform:
+        v.m_lfo_params.deforms[(int)parid - (int)ParamIDs::LFO0Deform] = value;
+        break;
+    case ParamIDs::PitchAdjust:
+        v.m_pitch_adjust_amount = value;
+        break;
+    case ParamIDs::UnisonCount:
+        v.setUnison(ival, v.m_unison_detune, v.m_unison_spread);
+        break;
+    case ParamIDs::UnisonDetune:
+        v.setUnison(v.m_unison_count, value, v.m_unison_spread);
+        break;
+    case ParamIDs::UnisonSpread:
+        v.setUnison(v.m_unison_count, v.m_unison_detune, value);
+        break;
+    case ParamIDs::NoiseBandwidth:
+        v.setBandwidth(value, v.m_bandwidth_tilt, v.m_bandwidth_cutoff);
+        break;
+    case ParamIDs::NoiseBandwidthTilt:
+        v.setBandwidth(v.m_bandwidth, value, v.m_bandwidth_cutoff);
+        break;
+    case ParamIDs::NoiseFilterCutoff:
+        v.setBandwidth(v.m_bandwidth, v.m_bandwidth_tilt, value);
+        break;
+    case ParamIDs::BurstMix:
+        v.m_adsr_burst_mix = value;
+        break;
+    case ParamIDs::BurstDuration:
+        bg.setParameters(value, bg.m_num_bursts, bg.getProbability(), bg.getDistribution());
+        break;
+    case ParamIDs::BurstCount:
+        bg.setParameters(bg.m_burst_duration, ival, bg.getProbability(), bg.getDistribution());
+        break;
+    case ParamIDs::BurstProbability:
+        bg.setParameters(bg.m_burst_duration, bg.m_num_bursts, value, bg.getDistribution());
+        break;
+    case ParamIDs::BurstDistribution:
+        bg.setParameters(bg.m_burst_duration, bg.m_num_bursts, bg.getProbability(), value);
+        break;
+    case ParamIDs::PartialEnvMode:
+        v.m_partial_envs.setEnabled(ival != 0);
+        break;
+    case ParamIDs::PartialEnvAttack:
+        v.m_partial_env_params.attack = value;
+        break;
+    case ParamIDs::PartialEnvDecay:
+        v.m_partial_env_params.decay = value;
+        break;
+    case ParamIDs::PartialEnvSustain:
+        v.m_partial_env_params.sustain = value;
+        break;
+    case ParamIDs::PartialEnvRelease:
+        v.m_partial_env_params.release = value;
+        break;
+    case ParamIDs::PartialEnvTilt:
+        v.m_partial_env_params.tilt = value;
+        break;
+    default:
+        break;
+    }
+}
+
+void AdditiveSynth::handleParameterValue(int port, int ch, int key, int note_id, clap_id parid,
+                                         double value)
+{
+    auto pid = (ParamIDs)parid;
+    // the parameters that aren't per voice
+    switch (pid)
+    {
+    case ParamIDs::PitchBendRange:
+        setPitchBendRange(value);
+        return;
+    case ParamIDs::VolumeMorphPreset:
+        m_shared_data.setVolumeMorphPreset((int)std::round(value));
+        return;
+    case ParamIDs::PanMorphPreset:
+        m_shared_data.setPanMorphPreset((int)std::round(value));
+        return;
+    case ParamIDs::SaturatorQuality:
+        setSaturatorQuality((int)std::round(value));
+        return;
+    case ParamIDs::PartialCullThreshold:
+        m_shared_data.setPartialCullThreshold(value);
+        return;
+    case ParamIDs::VoiceSilenceThreshold:
+        m_shared_data.setVoiceSilenceThreshold(value);
+        return;
+    case ParamIDs::PitchModQuantize:
+        m_shared_data.m_quantize_pitch_mod_mode = std::clamp((int)std::round(value), 0, 2);
+        return;
+    default:
+        break;
+    }
+    forEachTargetVoice(port, ch, key, note_id,
+                       [this, pid, value](AdditiveVoice &v) { applyVoiceParameter(v, pid, value); });
+}
+
+float AdditiveVoice::ParamModulation::*AdditiveSynth::getModulationField(ParamIDs parid)
+{
+    using PM = AdditiveVoice::ParamModulation;
+    switch (parid)
+    {
+    case ParamIDs::FilterMorph:
+        return &PM::filter_morph;
+    case ParamIDs::Pan:
+        return &PM::pan;
+    case ParamIDs::Volume:
+        return &PM::volume;
+    case ParamIDs::PartialsBalance:
+        return &PM::partials_balance;
+    case ParamIDs::PartialsPanMorph:
+        return &PM::partials_pan_morph;
+    case ParamIDs::FreqTweaksMix:
+        return &PM::tweaks_mix;
+    case ParamIDs::PitchAdjust:
+        return &PM::pitch;
+    default:
+        return nullptr;
+    }
+}
+
+void AdditiveSynth::handleParameterModulation(int port, int ch, int key, int note_id,
+                                              clap_id parid, double amount)
+{
+    auto field = getModulationField((ParamIDs)parid);
+    if (!field)
+        return;
+    if (note_id == -1 && key == -1 && ch == -1)
     {
-        // Find oldest playing voice and unceremoniously restart it
-        // Not a very good voice stealing method, but we need to have something
-        AdditiveVoice *stealfrom = nullptr;
-        int mintime = 100000000; // should be intmax
         for (auto &v : m_voices)
-        {
-            if (v.m_start_time_stamp < mintime)
-            {
-                mintime = v.m_start_time_stamp;
-                stealfrom = &v;
-            }
-        }
-        if (stealfrom)
-        {
-            startnotefunc(*stealfrom, port_index, channel, key, noteid, velo);
-        }
+            v.m_global_mods.*field = amount;
+        return;
+    }
+    forEachTargetVoice(port, ch, key, note_id,
+                       [field, amount](AdditiveVoice &v) { v.m_note_mods.*field = amount; });
+}
+
+void AdditiveSynth::handlePolyAfterTouch(int port_index, int channel, int note, float value)
+{
+    forEachVoiceOfKey(channel < 0 ? -1 : channel, note,
+                      [value](AdditiveVoice &v) { v.m_after_touch_amount = value; });
+}
+
+void AdditiveSynth::handleNoteOn(int port_index, int channel, int key, int noteid, double velo)
+{
+    // a previous note on the same key keeps playing and is still reachable by its note id and
+    // by the events for the key
+    AdditiveVoice *v = nullptr;
+    bool stolen = false;
+    if (!m_free_voices.empty())
+    {
+        v = m_free_voices.back();
+        m_free_voices.pop_back();
+        m_active_voices.push_back(v);
+    }
+    else
+    {
+        v = findVoiceToSteal();
+        if (!v)
+            return;
+        unindexVoice(v);
+        stolen = true;
+    }
+    m_note_id_voices.insert(noteid, v);
+    v->m_pitch_bend_amount = m_cur_pitch_bend;
+    v->m_start_time_stamp = m_time_pos_counter;
+    if (stolen)
+    {
+        v->beginNoteAfterFade(port_index, channel, key, noteid, velo);
+    }
+    else
+    {
+        v->beginNote(port_index, channel, key, noteid, velo);
+        v->updateState();
     }
+    // if we want to do something like this, should be a voice on triggered modulator or
+    // something
+    /*
+    if (m_note_counter == 0)
+        v.setPan(0.1);
+    else if (m_note_counter == 1)
+        v.setPan(0.5);
+    else v.setPan(0.9);
+    */
+    ++m_note_counter;
+    if (m_note_counter == 3)
+        m_note_counter = 0;
 }
 
 void AdditiveSynth::handleNoteOff(int port_index, int channel, int key, int noteid)
 {
     if (m_sustain_pedal)
         return;
-    for (auto &v : m_voices)
+    auto releasefunc = [](AdditiveVoice *v) {
+        v->endNote();
+        v->m_after_touch_amount = 0.0f;
+    };
+    if (noteid != -1)
     {
-        if (v.m_is_available == false && (v.m_cur_midi_note == key || key == -1))
-        {
-            v.endNote();
-            v.m_after_touch_amount = 0.0f;
-        }
+        // the voice may already have been stolen for another note
+        if (auto v = m_note_id_voices.find(noteid))
+            releasefunc(v);
+        return;
+    }
+    if (channel != -1 && key != -1)
+    {
+        forEachVoiceOfKey(channel, key, [&](AdditiveVoice &v) { releasefunc(&v); });
+        return;
+    }
+    // wildcards
+    for (auto v : m_active_voices)
+    {
+        if (key == -1 || v->m_cur_midi_note == key)
+            releasefunc(v);
     }
 }
 
@@ -1092,61 +2132,6 @@ void AdditiveSynth::handlePitchBend(int port_index, int channel, float value)
         }
     }
 }
-#ifdef HAVEJUCE
-juce::String AdditiveSynth::importKBMText(juce::String text)
-{
-    try
-    {
-        auto kbm = Tunings::parseKBMData(text.toStdString());
-        auto scale = m_shared_data.fundamental_tuning.scale;
-        Tunings::Tuning tuning = Tunings::Tuning(scale, kbm);
-        juce::SpinLock::ScopedLockType locker(m_cs);
-        m_shared_data.fundamental_tuning = tuning;
-    }
-    catch (const std::exception &e)
-    {
-        return e.what();
-    }
-    return "";
-}
-
-juce::String AdditiveSynth::importKBMFile(juce::File file)
-{
-    std::string fn = file.getFullPathName().toStdString();
-    try
-    {
-        auto kbm = Tunings::readKBMFile(fn);
-        auto scale = m_shared_data.fundamental_tuning.scale;
-        Tunings::Tuning tuning = Tunings::Tuning(scale, kbm);
-        juce::SpinLock::ScopedLockType locker(m_cs);
-        m_shared_data.fundamental_tuning = tuning;
-    }
-    catch (const std::exception &e)
-    {
-        return e.what();
-    }
-    return "";
-}
-#endif
-#ifdef HAVEJUCE
-juce::String AdditiveSynth::importScalaFile(juce::File file)
-{
-    std::string fn = file.getFullPathName().toStdString();
-    try
-    {
-        auto scale = Tunings::readSCLFile(fn);
-        auto kbm = Tunings::startScaleOnAndTuneNoteTo(m_kbm_start_note, m_kbm_ref_note, m_kbm_freq);
-        Tunings::Tuning tuning = Tunings::Tuning(scale, kbm);
-        juce::SpinLock::ScopedLockType locker(m_cs);
-        m_shared_data.fundamental_tuning = tuning;
-    }
-    catch (const std::exception &e)
-    {
-        return e.what();
-    }
-    return "";
-}
-#endif
 void AdditiveSynth::setEDOParameters(double pseudoOctaveCents, int edo)
 {
 
@@ -1157,9 +2142,11 @@ void AdditiveSynth::setEDOParameters(double pseudoOctaveCents, int edo)
 
             // double t0 = juce::Time::getMillisecondCounterHiRes();
             auto scale = Tunings::evenDivisionOfCentsByM(pseudoOctaveCents, edo);
-            auto kbm = m_shared_data.fundamental_tuning.keyboardMapping;
+            auto kbm = m_shared_data.getLatestPublishedTuning().keyboardMapping;
             auto tuning = Tunings::Tuning(scale, kbm);
-            m_shared_data.fundamental_tuning = tuning;
+            auto error = m_shared_data.publishTuning(tuning);
+            if (!error.empty())
+                throw std::runtime_error(error);
             // double t1 = juce::Time::getMillisecondCounterHiRes();
             m_tuning_update_elapsed_ms = 0.0f;
             m_pseudo_octave = pseudoOctaveCents;
@@ -1175,33 +2162,33 @@ void AdditiveSynth::setEDOParameters(double pseudoOctaveCents, int edo)
     }
 }
 
-float BurstGenerator::process()
+void BurstGenerator::updateSchedule()
+{
+    for (int i = 0; i < m_num_bursts; ++i)
+        m_onsets[i] = getBurstTime(i) * m_sr;
+}
+
+void BurstGenerator::processBlock()
 {
-    float output = 0.0;
-    // ok, obviously this isn't as efficient as it should be, but will do for now
-    float tposnorm = getBurstTime(m_counter);
-    if (m_counter < m_num_bursts && std::abs(m_phase - tposnorm * m_sr) <= 1.0)
+    const double blockend = m_phase + SRProvider::BLOCK_SIZE;
+    // the onsets falling on this block, usually none
+    while (m_counter < m_num_bursts && m_onsets[m_counter] < blockend)
     {
         if (m_dist(m_rng) < m_probability)
-        {
             env.attackFrom(cur_out, 0.0f, 0, true);
-        }
         ++m_counter;
     }
-    m_phase += 1.0;
-    env.process(0.01, 0.3, 0.00, 0.6, 0, 0, 0, m_counter <= m_num_bursts);
-    output = env.output;
-    // jassert(output>=0.0 && output<=1.0);
-    cur_out = output;
+    env.processBlock(0.01, 0.3, 0.00, 0.6, 0, 0, 0, true);
+    cur_out = env.outputCache[SRProvider::BLOCK_SIZE - 1];
+    m_phase = blockend;
     if (m_auto_repeat && m_phase >= m_burst_duration * m_sr)
     {
-        begin();
+        m_phase -= m_burst_duration * m_sr;
+        m_counter = 0;
     }
-
-    return output;
 }
 
-float BurstGenerator::getBurstTime(int index)
+float BurstGenerator::getBurstTime(int index) const
 {
     float tposnorm = 1.0 / m_num_bursts * index;
     tposnorm = xenakios::jlimit(0.0f, 1.0f, tposnorm);
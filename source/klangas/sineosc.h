@@ -4,15 +4,28 @@
 // #include <juce_dsp/juce_dsp.h>
 #include "Tunings.h"
 #include <pmmintrin.h>
-#include "sst/basic-blocks/modulators/SimpleLFO.h"
 #include "sst/basic-blocks/modulators/ADSREnvelope.h"
 #include <utility>
 #include <optional>
 #include "../xap_utils.h"
 #include "audio/choc_SampleBuffers.h"
 #include <mutex>
+#include <span>
+#include <memory>
+#include <vector>
 #include "sst/basic-blocks/dsp/FollowSlewAndSmooth.h"
 #include "../common.h"
+#include "snapshotexchange.h"
+#include "fastmath.h"
+#include "saturator.h"
+#include "morphtable.h"
+#include "voiceindex.h"
+#include "triplebuffer.h"
+#include "partialenvelopes.h"
+#include "noisebank.h"
+#include "lfobank.h"
+#include "taskworker.h"
+#include "../envelopebank.h"
 
 namespace xenakios
 {
@@ -20,6 +33,35 @@ template <typename T> inline T jlimit(T minval, T maxval, T val)
 {
     return std::clamp(val, minval, maxval);
 }
+// for the constants, std::log2 isn't constexpr. x must be positive
+constexpr double constexprLog2(double x)
+{
+    int whole = 0;
+    while (x >= 2.0)
+    {
+        x /= 2.0;
+        ++whole;
+    }
+    while (x < 1.0)
+    {
+        x *= 2.0;
+        --whole;
+    }
+    // the fraction bit by bit, squaring doubles the remaining logarithm
+    double frac = 0.0;
+    double bit = 0.5;
+    for (int i = 0; i < 48; ++i)
+    {
+        x *= x;
+        if (x >= 2.0)
+        {
+            x /= 2.0;
+            frac += bit;
+        }
+        bit *= 0.5;
+    }
+    return whole + frac;
+}
 } // namespace xenakios
 
 struct SRProvider
@@ -60,6 +102,116 @@ struct SRProvider
   private:
 };
 
+// Immutable tuning data used by the audio thread. New snapshots are built on non-audio
+// threads and swapped in with SnapshotExchange, so tuning changes never block the audio thread.
+struct TuningSnapshot
+{
+    TuningSnapshot(const Tunings::Tuning &t, uint64_t serial_);
+    const Tunings::Tuning tuning;
+    // increases with every published tuning, so users can detect changes without having
+    // to compare (possibly already deleted) snapshot addresses
+    const uint64_t serial = 0;
+    // the table covers the same key range as Tunings::Tuning, that is, the MIDI range
+    // extended by the scale repeating with its (pseudo) octave in both directions
+    static constexpr int firstkey = -256;
+    static constexpr int numkeys = Tunings::Tuning::N;
+    // log2 of the key frequency relative to MIDI note 0, multiplied by 12, so in "semitones".
+    // there's an extra guard entry at the end, so interpolation can always read the next entry
+    alignas(32) std::array<float, numkeys + 1> key_pitches;
+    // interpolated lookup, equivalent to interpolating logScaledFrequencyForMidiNote * 12
+    float pitchForKey(float key) const
+    {
+        float pos = std::clamp(key - (float)firstkey, 0.0f, (float)(numkeys - 1));
+        int idx = (int)pos;
+        float frac = pos - idx;
+        return key_pitches[idx] + (key_pitches[idx + 1] - key_pitches[idx]) * frac;
+    }
+    // an error text if the tuning can't be used, otherwise empty
+    std::string validate() const;
+};
+
+// Tables that are the same for every KlangAS instance. They are generated once per process, on
+// first use, and then only read, so all the instances and voices can share them.
+struct AdditiveStaticTables
+{
+    static const AdditiveStaticTables &get();
+    static constexpr int maxampframes = 16;
+    static constexpr int numamppresets = 9;
+    static constexpr int num_panpresets = 4;
+    static constexpr int maxpanframes = 16;
+    static constexpr int numtablepartials = 64;
+    using MorphTableType = std::array<std::array<float, numtablepartials>, maxampframes + 1>;
+    alignas(32) std::array<MorphTableType, numamppresets> volumepresets;
+    alignas(32) std::array<MorphTableType, num_panpresets> pan_morph_presets;
+    alignas(32) std::array<float, 64> voice_random_filter_gains;
+    alignas(32) std::array<std::array<float, 512>, 2> pan_coefficients;
+    static constexpr float minpartialfrequency = Tunings::MIDI_0_FREQ;
+    static constexpr float maxpartialfrequency = 20000.0f;
+    static constexpr float safety_low_cutoff = 20.0f;
+    static constexpr float safety_high_cutoff = 15000.0f;
+    alignas(32) std::array<float, 2048> safety_filter;
+
+    static constexpr int num_shaping_filter_modes = 5;
+    // octave range of the partials
+    static constexpr float maxpartialoctave =
+        (float)xenakios::constexprLog2((double)maxpartialfrequency / minpartialfrequency);
+    static constexpr int shaping_filter_octave_points = 257;
+    static constexpr int shaping_filter_morph_points = 65;
+    // the shaping filter responses rendered for each filter mode, indexed by morph and octave,
+    // with guard points at the ends for the interpolation
+    using ShapingFilterTable = std::array<std::array<float, shaping_filter_octave_points + 1>,
+                                          shaping_filter_morph_points + 1>;
+    alignas(32) std::array<ShapingFilterTable, num_shaping_filter_modes> shaping_filter_tables;
+    // the actual filter responses, used to render the tables
+    float calculateShapingFilterGain(int mode, float octave, float morph) const;
+
+    // the partial frequency tweak modes as ratios to the unmodified partial frequencies. the
+    // random mode has a bank of tables, so that the voices don't all get the same one
+    static constexpr int num_freq_tweak_modes = 6;
+    static constexpr int random_freq_tweak_mode = 1;
+    static constexpr int num_random_freq_tweak_tables = 16;
+    using FreqTweakTable = std::array<float, numtablepartials>;
+    alignas(32) std::array<FreqTweakTable, num_freq_tweak_modes> freq_tweak_ratios;
+    alignas(32) std::array<FreqTweakTable, num_random_freq_tweak_tables> random_freq_tweak_ratios;
+
+  private:
+    AdditiveStaticTables();
+    void generateAmplitudeMorphTablePresets();
+    void generatePanMorphTablePresets();
+    void generateShapingFilterTables();
+    void generateFreqTweakTables();
+};
+
+// Key to pitch mapping from an external tuning source like MTS-ESP, covering the MIDI keys
+struct KeyPitchTable
+{
+    static constexpr int numkeys = 128;
+    // when not active, the tuning from Tunings::Tuning is used
+    bool active = false;
+    // in the same units as TuningSnapshot::key_pitches, with a guard entry at the end
+    alignas(32) std::array<float, numkeys + 1> key_pitches{};
+    // outside the MIDI range the pitches continue in 12 EDO from the end keys
+    float pitchForKey(float key) const
+    {
+        if (key < 0.0f)
+            return key_pitches[0] + key;
+        if (key >= numkeys - 1)
+            return key_pitches[numkeys - 1] + (key - (numkeys - 1));
+        int idx = (int)key;
+        float frac = key - idx;
+        return key_pitches[idx] + (key_pitches[idx + 1] - key_pitches[idx]) * frac;
+    }
+};
+
+// Polled by the audio thread at control rate for changes in an external tuning
+class KeyTuningSource
+{
+  public:
+    virtual ~KeyTuningSource() {}
+    // updates the table if the tuning has changed, returns true if it did
+    virtual bool pollKeyPitches(KeyPitchTable &table) = 0;
+};
+
 class AdditiveSharedData
 {
   public:
@@ -90,48 +242,117 @@ class AdditiveSharedData
         MOT_AUX_SEND_A,
         MOT_LAST
     };
+    // the modulation depths as edited, only used by non-audio threads. the audio thread uses
+    // the compiled version that only has the non-zero routings
     alignas(16) float modmatrix[AdditiveSharedData::MOS_LAST][AdditiveSharedData::MOT_LAST];
+    struct ModRouting
+    {
+        int source = 0;
+        int target = 0;
+        float depth = 0.0f;
+    };
+    struct CompiledModMatrix
+    {
+        std::array<ModRouting, (int)MOS_LAST * (int)MOT_LAST> routings;
+        int numroutings = 0;
+    };
+    // non-audio threads, compiles and publishes the matrix
+    void setModulationDepth(int source, int target, float amount);
+    // non-audio threads, all the depths source after source, for the state saving. setting
+    // compiles and publishes the matrix once
+    std::vector<float> getModulationDepths();
+    void setModulationDepths(const std::vector<float> &depths);
+    // audio thread
+    bool updateModMatrix() { return m_modmatrix_exchange.update(); }
+    const CompiledModMatrix &getModMatrix() const { return *m_modmatrix_exchange.get(); }
     AdditiveSharedData();
     int m_quantize_pitch_mod_mode = 1;
-    alignas(32) static const int maxampframes = 16;
-    alignas(32) static const int numamppresets = 9;
-    alignas(32) static const int num_panpresets = 4;
-    using MorphTableType = std::array<std::array<float, 64>, maxampframes + 1>;
+    // shared by all instances, never null
+    const AdditiveStaticTables *m_tables = nullptr;
+    static constexpr int maxampframes = AdditiveStaticTables::maxampframes;
+    static constexpr int numamppresets = AdditiveStaticTables::numamppresets;
+    static constexpr int num_panpresets = AdditiveStaticTables::num_panpresets;
+    using MorphTableType = AdditiveStaticTables::MorphTableType;
     alignas(32) MorphTableType partialsmorphtable;
-    alignas(32) std::array<MorphTableType, numamppresets> volumepresets;
-    alignas(32) std::array<MorphTableType, num_panpresets> pan_morph_presets;
-    static constexpr int maxpanframes = 16;
+    static constexpr int maxpanframes = AdditiveStaticTables::maxpanframes;
     alignas(32) std::array<std::array<float, 64>, maxpanframes + 1> partialspanmorphtable;
-    Tunings::Tuning fundamental_tuning;
     Tunings::KeyboardMapping kbm;
+    // non-audio thread, builds and validates the key tables and hands them over to the audio
+    // thread. returns an error text and leaves the current tuning in use if the tuning is invalid
+    std::string publishTuning(const Tunings::Tuning &tuning);
+    // non-audio thread, the most recently published tuning, to build modified tunings from
+    Tunings::Tuning getLatestPublishedTuning()
+    {
+        std::lock_guard<std::mutex> locker(m_tuning_publish_mutex);
+        return m_latest_published_tuning;
+    }
+    // audio thread, takes the latest published tuning into use, returns true if it changed
+    bool updateTuning() { return m_tuning_exchange.update(); }
+    // audio thread
+    const TuningSnapshot &getTuning() const { return *m_tuning_exchange.get(); }
     void initKeyMapEDO(double referenceFrequency, double pseudoOctave, int edo);
-    void initKeyMapFromScala(double referenceFrequency, double pseudoOctave, std::string fn);
     void updateExtraMorphFrame();
-    void generateAmplitudeMorphTablePresets();
-    void generatePanMorphTablePresets();
+    // numamppresets selects the user table, loaded_morph_table_preset the table published with
+    // publishLoadedMorphTable
     void setVolumeMorphPreset(int index);
+    static constexpr int loaded_morph_table_preset = numamppresets + 1;
+    // non-audio thread, hands a loaded morph table over to the audio thread. nullptr takes the
+    // loaded table out of use
+    void publishLoadedMorphTable(std::unique_ptr<CompactMorphTable> table)
+    {
+        // the exchange can't pass nullptr, so no table is passed as a table with the serial 0
+        if (table)
+            table->m_serial = ++m_loaded_morph_table_serial;
+        else
+            table = std::make_unique<CompactMorphTable>(1, 1);
+        m_loaded_morph_table_exchange.publish(std::move(table));
+    }
+    // audio thread, takes the latest published morph table into use
+    bool updateLoadedMorphTable() { return m_loaded_morph_table_exchange.update(); }
+    // audio thread, the loaded table if it has been selected as the volume morph preset
+    const CompactMorphTable *getLoadedMorphTableInUse() const
+    {
+        if (!m_use_loaded_morph_table)
+            return nullptr;
+        return getLoadedMorphTable();
+    }
+    // audio thread, the loaded table regardless of the volume morph preset, for the frequency
+    // ratios
+    const CompactMorphTable *getLoadedMorphTable() const
+    {
+        auto table = m_loaded_morph_table_exchange.get();
+        if (!table || table->getSerial() == 0)
+            return nullptr;
+        return table;
+    }
     void setPanMorphPreset(int index);
 
-    alignas(32) std::array<float, 64> voice_random_filter_gains;
-    alignas(32) std::array<std::array<float, 512>, 2> pan_coefficients;
     //
     inline float remapKeyInMidiOnlyMode(float res)
     {
+        if (m_external_key_pitches.active)
+            return m_external_key_pitches.pitchForKey(res);
         // if (!isStandardTuning && tuningApplicationMode == RETUNE_MIDI_ONLY)
         {
-            auto idx = (int)floor(res);
-            float frac = res - idx; // frac is 0 means use idx; frac is 1 means use idx + 1
-            float b0 = fundamental_tuning.logScaledFrequencyForMidiNote(idx) * 12;
-            float b1 = fundamental_tuning.logScaledFrequencyForMidiNote(idx + 1) * 12;
-            res = (1.f - frac) * b0 + frac * b1;
+            res = getTuning().pitchForKey(res);
         }
         return res;
     }
+    // audio thread only, updated from the key tuning source of the synth
+    KeyPitchTable m_external_key_pitches;
     bool m_using_custom_kbm = false;
     int m_cur_pan_morph_preset = -1;
 
     int m_cur_vol_morph_preset = -1;
     SRProvider sst_provider;
+    // the LFOs of all the voices
+    LFOBank m_lfo_bank{&sst_provider};
+    // the amplitude and modulation envelopes of all the voices, advanced by the synth
+    using VoiceEnvelopeBank = ADSREnvelopeBank<SRProvider::BLOCK_SIZE, LFOBank::maxvoices>;
+    VoiceEnvelopeBank m_amp_envs;
+    VoiceEnvelopeBank m_mod_envs;
+    // the position of the section being rendered within the envelope control block
+    int m_env_block_pos = 0;
     const MorphTableType &getUserMorphTableForRead() const { return partialsmorphtable_custom; }
     // always marks user morph table dirty, so best to actually make some changes into it
     MorphTableType &getUserMorphTableForWrite()
@@ -142,8 +363,8 @@ class AdditiveSharedData
     // static AdditiveSharedData::MorphTableType readFromFile(juce::File f);
     // static juce::String getTableAsText(const AdditiveSharedData::MorphTableType &tab,
     //                                   bool format_for_code);
-    static constexpr float minpartialfrequency = Tunings::MIDI_0_FREQ;
-    static constexpr float maxpartialfrequency = 20000.0f;
+    static constexpr float minpartialfrequency = AdditiveStaticTables::minpartialfrequency;
+    static constexpr float maxpartialfrequency = AdditiveStaticTables::maxpartialfrequency;
     static float frequencyAsOctave(float Hz)
     {
         // should probably use a look up table for this...
@@ -153,30 +374,85 @@ class AdditiveSharedData
     {
         return minpartialfrequency * std::pow(2.0f, octave);
     }
-    float low_cutoff = 64.0f;
-    float high_cutoff = 10000.0;
     float getSafetyFilterCoefficient(float hz);
-    alignas(32) std::array<float, 2048> safety_filter;
+    // partials whose gain, before the voice envelope and volume, stays below this during a
+    // control block are not rendered
+    void setPartialCullThreshold(float db)
+    {
+        m_partial_cull_threshold_db = db;
+        m_partial_cull_gain = xenakios::decibelsToGain(db, -300.0f);
+    }
+    float m_partial_cull_threshold_db = -120.0f;
+    float m_partial_cull_gain = 1.0e-6f;
+    // released voices whose output peak stays below the threshold for voice_silence_blocks
+    // control blocks (about 12 ms at 44.1 kHz) are freed without waiting for the envelope to
+    // finish
+    void setVoiceSilenceThreshold(float db)
+    {
+        m_voice_silence_threshold_db = db;
+        m_voice_silence_gain = xenakios::decibelsToGain(db, -300.0f);
+    }
+    float m_voice_silence_threshold_db = -96.0f;
+    float m_voice_silence_gain = 1.5849e-5f;
+    static constexpr int voice_silence_blocks = 16;
+    // how often the voices publish their visualization snapshots
+    void setVisualizationRate(float hz) { m_vis_publish_hz = std::clamp(hz, 1.0f, 200.0f); }
+    float m_vis_publish_hz = 30.0f;
+
+    static constexpr int num_shaping_filter_modes = AdditiveStaticTables::num_shaping_filter_modes;
+    // bilinear table lookup of the shaping filter gains for numpartials frequencies in hz,
+    // done 4 partials at a time with SSE, so the arrays should have space for numpartials
+    // rounded up to a multiple of 4
+    void getShapingFilterGains(int mode, float morph, const float *hz, float *gains,
+                               int numpartials) const;
 
   private:
     alignas(32) MorphTableType partialsmorphtable_custom;
     bool m_custom_morph_table_dirty = true;
+    std::atomic<bool> m_use_loaded_morph_table{false};
+    SnapshotExchange<CompactMorphTable> m_loaded_morph_table_exchange;
+    std::atomic<uint64_t> m_loaded_morph_table_serial{0};
+    SnapshotExchange<TuningSnapshot> m_tuning_exchange;
+    SnapshotExchange<CompiledModMatrix> m_modmatrix_exchange;
+    std::mutex m_modmatrix_mutex;
+    // guards the publishing side state, never touched by the audio thread
+    std::mutex m_tuning_publish_mutex;
+    Tunings::Tuning m_latest_published_tuning;
+    uint64_t m_tuning_serial = 0;
 };
 
 using VoiceEG = sst::basic_blocks::modulators::ADSREnvelope<SRProvider, SRProvider::BLOCK_SIZE>;
-using SimpleLFO = sst::basic_blocks::modulators::SimpleLFO<SRProvider, SRProvider::BLOCK_SIZE>;
 
+/*
+Triggers short envelopes at a number of onset times within the burst duration, optionally
+repeating. The onset times are calculated when the parameters change and the envelope is
+rendered a control block at a time, so running it costs about as much as the other envelopes.
+The onsets are quantized to the control blocks.
+*/
 class BurstGenerator
 {
   public:
+    static constexpr int maxbursts = 64;
     BurstGenerator(SRProvider *ss) : env(ss) { setParameters(1.0, 4, 1.0, 0.5); }
-    void setSampleRate(double sr) { m_sr = sr; }
+    void setSampleRate(double sr)
+    {
+        if (sr == m_sr)
+            return;
+        m_sr = sr;
+        updateSchedule();
+    }
+    // only recalculates the onset schedule if something changed
     void setParameters(double dur, int numbursts, double prob, double distrib)
     {
+        numbursts = std::clamp(numbursts, 1, maxbursts);
+        if (dur == m_burst_duration && numbursts == m_num_bursts && prob == m_probability &&
+            distrib == m_distrib)
+            return;
         m_burst_duration = dur;
         m_num_bursts = numbursts;
         m_probability = prob;
         m_distrib = distrib;
+        updateSchedule();
     }
     void begin()
     {
@@ -184,14 +460,22 @@ class BurstGenerator
         m_counter = 0;
         cur_out = 0.0f;
     }
-    float getBurstTime(int index);
-    float process();
+    double getProbability() const { return m_probability; }
+    double getDistribution() const { return m_distrib; }
+    float getBurstTime(int index) const;
+    // renders the next control block of the envelope
+    void processBlock();
+    // the output of the latest rendered block
+    float getOutput(int index) const { return env.outputCache[index]; }
     float cur_out = 0.0f;
     bool m_auto_repeat = true;
     int m_num_bursts = 8;
     double m_burst_duration = 1.0;
 
   private:
+    void updateSchedule();
+    // in samples, ascending
+    std::array<double, maxbursts> m_onsets{};
     double m_phase = 0.0;
     double m_sr = 44100;
     int m_counter = 0;
@@ -202,7 +486,25 @@ class BurstGenerator
     VoiceEG env;
 };
 
-class AdditiveVoice
+// The state of a voice for visualization, published by the audio thread at a throttled rate
+struct VoiceVisSnapshot
+{
+    static constexpr int maxpartials = 64;
+    bool active = false;
+    int numpartials = 0;
+    float lowestfreq = 0.0f;
+    float highestfreq = 0.0f;
+    // the amplitude envelope with the volume modulation applied
+    float envelopegain = 0.0f;
+    float ampmorph = 0.0f;
+    // the partial gains are before the voice envelope and volume
+    std::array<float, maxpartials> freqs{};
+    std::array<float, maxpartials> amplitudes{};
+    std::array<float, maxpartials> pans{};
+};
+
+// aligned to cache lines, so that neighbouring voices in the voice pool don't share lines
+class alignas(64) AdditiveVoice
 {
   public:
     alignas(16) int m_num_partials = 1;
@@ -233,35 +535,40 @@ class AdditiveVoice
     float m_pitch_lfo_mod = 0.0f;
 
     float m_volume_lfo_mod = 0.0f; // dB
-    std::atomic<bool> m_frequencies_ready_to_show{false};
-    int m_update_throttle = 0;
     void setPseudoOctave(float po) { m_pseudo_octave = po; }
     int getNumPartials() { return m_num_partials; }
-    float getPartialFrequency(int index, bool is_for_gui)
+    // audio thread
+    float getPartialFrequency(int index)
     {
         if (index >= 0 && index < m_num_partials)
-        {
-            if (!is_for_gui)
-                return m_partial_freqs[index];
-            return m_partial_freqs_vis[index];
-        }
+            return m_partial_freqs[index];
         return 1.0f;
     }
-    float getPartialAmplitude(int index)
+    // GUI thread, never waits for the audio thread. the reference is valid until the next call
+    const VoiceVisSnapshot &getVisSnapshot()
     {
-        if (index >= 0 && index < m_num_partials)
-        {
-            return m_partial_amplitudes[index];
-        }
-        return 0.0f;
+        m_vis_buffer.update();
+        return m_vis_buffer.getReadBuffer();
     }
     void setTuningMode(int m) { m_tuning_mode = m; }
     void setEDO(int edo) { m_edo = edo; }
 
-    std::array<float, 4> m_lfo_rates;
-    std::array<int, 4> m_lfo_types;
-    std::array<float, 4> m_lfo_deforms;
+    // the shapes are the LFOBank shapes
+    LFOBank::VoiceParams m_lfo_params;
+    // the voice's slot in the shared LFO and envelope banks
+    void setSlot(int slot) { m_slot = slot; }
+    int getSlot() const { return m_slot; }
+    // called by the synth when the amplitude envelope has ended
+    void envelopeFinished() { m_amp_env_finished = true; }
+    // recalculates the partial frequencies, phase increments and filter gains, but only for
+    // the stages whose inputs have changed since the previous call
     void updateState();
+    // forces the next updateState to recalculate everything
+    void invalidateState()
+    {
+        m_last_freq_inputs = PartialFreqInputs{};
+        m_last_filter_inputs = ShapingFilterInputs{};
+    }
     void postProcessUpdate(int nframes);
     struct EGParams
     {
@@ -283,6 +590,22 @@ class AdditiveVoice
         pars->r = r;
         m_adsr_sustain_level = s;
     }
+    // each partial can be played as up to maxunison copies, detuned symmetrically by up to
+    // detunecents and spread around the partial pan position by spread (0 to 1)
+    static constexpr int maxunison = 4;
+    void setUnison(int count, float detunecents, float spread);
+    int m_unison_count = 1;
+    float m_unison_detune = 10.0f;
+    float m_unison_spread = 0.5f;
+    // amplitude modulation of the partials with narrow band noise, 0 is pure sinusoids and 1
+    // only noise. the tilt (-1 to 1) moves the bandwidth from the lower to the higher partials
+    void setBandwidth(float amount, float tilt, float cutoffhz);
+    float m_bandwidth = 0.0f;
+    float m_bandwidth_tilt = 0.0f;
+    float m_bandwidth_cutoff = 500.0f;
+    // optional envelopes for the individual partials, on top of the main amplitude envelope
+    PartialEnvelopeBank m_partial_envs;
+    PartialEnvelopeBank::Parameters m_partial_env_params;
     int m_note_id = -1;
     int m_note_channel = 0;
     int m_note_port = 0;
@@ -292,8 +615,59 @@ class AdditiveVoice
     bool m_eg_gate = false;
     void beginNote(int port_index, int channel, int key, int noteid, double velo);
 
-    void endNote() { m_eg_gate = false; }
+    // starts the note after a short fade out of the currently playing one, so a stolen voice
+    // can be reused without a click
+    void beginNoteAfterFade(int port_index, int channel, int key, int noteid, double velo);
+    static constexpr int steal_fade_len = 2 * SRProvider::BLOCK_SIZE;
+    bool isStealFading() const { return m_pending_note.active; }
+    // the note the voice is playing, or going to play after the steal fade
+    void getScheduledNote(int &channel, int &key, int &noteid) const
+    {
+        if (m_pending_note.active)
+        {
+            channel = m_pending_note.channel;
+            key = m_pending_note.key;
+            noteid = m_pending_note.noteid;
+            return;
+        }
+        channel = m_note_channel;
+        key = m_cur_midi_note;
+        noteid = m_note_id;
+    }
+    void endNote()
+    {
+        // a note off during the steal fade is for the note that hasn't started yet
+        if (m_pending_note.active)
+            m_pending_note.released = true;
+        else
+        {
+            m_eg_gate = false;
+            m_shared_data->m_amp_envs.setGate(m_slot, false);
+            m_shared_data->m_mod_envs.setGate(m_slot, false);
+            m_partial_envs.noteOff();
+        }
+    }
+    // peak output level of the last completed control block
+    float getLastBlockPeak() const { return m_last_block_peak; }
     void setPan(float p) { m_pan = p; }
+    // offsets from CLAP parameter modulation. the global ones are the same for all voices, the
+    // note ones are for the note the voice is playing and are cleared when a note starts
+    struct ParamModulation
+    {
+        float filter_morph = 0.0f;
+        float pan = 0.0f;
+        float volume = 0.0f; // dB
+        float partials_balance = 0.0f;
+        float partials_pan_morph = 0.0f;
+        float tweaks_mix = 0.0f;
+        float pitch = 0.0f; // semitones
+    };
+    ParamModulation m_global_mods;
+    ParamModulation m_note_mods;
+    float getParamModulation(float ParamModulation::*field) const
+    {
+        return m_global_mods.*field + m_note_mods.*field;
+    }
     void setPartialsPanMorph(float m) { m_partials_pan_morph = m; }
     void setKeyShift(int s) { m_key_shift = s; }
     int m_cur_midi_note = -1;
@@ -304,12 +678,10 @@ class AdditiveVoice
     alignas(16) float block_output[4][256];
     float m_aux_send_a = 0.0f;
     static const int maxnumpartials = 64;
-    std::optional<VoiceEG> m_eg0;
-    std::optional<VoiceEG> m_eg1;
-    float m_adsr_vis_amp = 0.0f;
-    float m_amp_morph_vis = 0.0f;
     bool m_is_available = true;
-    int m_start_time_stamp = 0;
+    int64_t m_start_time_stamp = 0;
+    // number of control blocks rendered by this voice since it was created, for profiling
+    uint64_t getActivityCounter() const { return m_activity_counter; }
     // in "keys", so straightforward for EDOs with standard keyboard
     // mapping, but more involved to deal with non-EDO and/or non-standard KBM scenarios...
     float m_pitch_bend_amount = 0.0f;
@@ -317,31 +689,122 @@ class AdditiveVoice
     float m_after_touch_amount = 0.0f; // unipolar 0-1
 
     std::optional<BurstGenerator> m_burst_gen;
-    float m_adsr_burst_mix = 0.5f;
+    float m_adsr_burst_mix = 0.0f;
     float m_freq_tweaks_mix = 0.0f;
     float m_freq_tweaks_mix_mod = 0.0f;
     int m_freq_tweaks_mode = 0;
-    float m_cur_lowest_freq = 0.0;  // should maybe be atomic...
-    float m_cur_highest_freq = 0.0; // likewise
+    // uses the frequency ratios of the loaded morph table, for example from the analyzer
+    static constexpr int loaded_table_tweaks_mode = 6;
+    float m_cur_lowest_freq = 0.0;
+    float m_cur_highest_freq = 0.0;
     alignas(32) bool modulator_unipolar[AdditiveSharedData::MOS_LAST];
     alignas(32) std::array<float, maxnumpartials + 4> m_output_samples;
-    alignas(32) std::array<float, maxnumpartials> m_partial_pans;
 
   private:
     alignas(32) std::array<float, maxnumpartials> m_partial_freqs;
-    alignas(32) std::array<float, maxnumpartials> m_partial_freqs_vis;
-    alignas(32) std::array<std::array<float, maxnumpartials>, 6> m_partial_freq_tweak_ratios;
+    // points to the shared tables
+    std::array<const float *, AdditiveStaticTables::num_freq_tweak_modes>
+        m_partial_freq_tweak_ratios;
 
     alignas(32) std::array<float, maxnumpartials> m_partial_phases;
     alignas(32) std::array<float, maxnumpartials> m_partial_phaseincs;
-    alignas(32) std::array<float, maxnumpartials> m_partial_amplitudes;
     alignas(32) std::array<float, maxnumpartials> m_partial_safetyfiltergains;
     alignas(32) std::array<float, maxnumpartials> m_partial_shapingfiltergains;
+    // the loaded morph table gains, decoded once per control block or when the table changes
+    alignas(32) std::array<float, maxnumpartials> m_loaded_table_gains;
+    uint64_t m_loaded_table_gains_serial = 0;
     alignas(32) std::array<float, maxnumpartials> m_partial_vol_smoothing_history;
     alignas(32) std::array<float, maxnumpartials> m_partial_pan_smoothing_history;
     float m_gain_smoothing_coeff = 0.999f;
+    // the gain smoothing coefficient over a whole control block
+    float m_gain_smoothing_block_coeff = 0.9f;
     float m_pan_smoothing_coeff = 0.999;
-    float getShapingFilterGain(float hz);
+    // indices of the partials loud enough to be rendered during the current control block,
+    // plus padding to the SIMD width
+    alignas(32) std::array<int, maxnumpartials + 4> m_active_partial_indices;
+    // the phases of the unison copies, the copies of each partial next to each other. only used
+    // when there are more than 1 copies, otherwise m_partial_phases is used
+    alignas(32) std::array<float, maxnumpartials * maxunison> m_unison_phases;
+    std::array<float, maxunison> m_unison_ratios{1.0f, 1.0f, 1.0f, 1.0f};
+    // in pan coefficient table steps
+    std::array<int, maxunison> m_unison_pan_offsets{};
+    float m_unison_gain = 1.0f;
+    void resetUnisonPhases();
+    // the noise modulators run in the same lanes as the sines
+    static constexpr int numnoiselanes = maxnumpartials * maxunison + 4;
+    BandwidthNoiseBank<numnoiselanes> m_noise_bank;
+    std::array<float, maxnumpartials> m_partial_bandwidths{};
+    // the unison count the noise lanes were last set up for
+    int m_noise_lanes_unison = 0;
+    // partial * maxunison + unison copy of the oscillator in each noise lane, -1 for unused
+    // lanes. the filter states follow the oscillators when the active partials change
+    std::array<int, numnoiselanes> m_noise_lane_oscs;
+    void updateNoiseLanes();
+    int m_num_active_partials = 0;
+    void updateActivePartials(int frame0, int frame1, const CompactMorphTable *loadedtable);
+    // evaluates the active modulation routings at the end of the control block
+    void evaluateModulation();
+    alignas(16) std::array<float, AdditiveSharedData::MOT_LAST> m_mod_dest_start;
+    alignas(16) std::array<float, AdditiveSharedData::MOT_LAST> m_mod_dest_end;
+    bool m_mod_dest_start_invalid = true;
+    // called at the end of each control block, frees the voice when the envelope has finished
+    // or when the output has been silent long enough after the note off
+    void checkVoiceFinished();
+    float m_block_peak = 0.0f;
+    float m_last_block_peak = 0.0f;
+    int m_silent_blocks = 0;
+    struct PendingNote
+    {
+        bool active = false;
+        bool released = false;
+        int port = 0;
+        int channel = 0;
+        int key = 0;
+        int noteid = -1;
+        double velo = 0.0;
+    };
+    PendingNote m_pending_note;
+    int m_steal_fade_pos = 0;
+    uint64_t m_activity_counter = 0;
+    // the visualization data is gathered from the synthesis state once in a while, instead of
+    // being written for every sample
+    void publishVisSnapshot();
+    TripleBuffer<VoiceVisSnapshot> m_vis_buffer;
+    int m_vis_blocks_counter = 0;
+    void updatePartialFrequencies();
+    const CompactMorphTable *getFreqRatiosTable() const
+    {
+        if (m_freq_tweaks_mode != loaded_table_tweaks_mode)
+            return nullptr;
+        return m_shared_data->getLoadedMorphTable();
+    }
+    void updatePseudoOctaveRatios();
+    // frequency ratios of the partials for m_partial_po_ratios_octave, only calculated again
+    // when the pseudo octave changes
+    alignas(32) std::array<float, maxnumpartials> m_partial_po_ratios;
+    float m_partial_po_ratios_octave = -1.0f;
+    // inputs used in the previous updateState, the defaults never match real inputs
+    struct PartialFreqInputs
+    {
+        float fundamental = -1.0f;
+        float pseudo_octave = -1.0f;
+        float tweaks_mix = -1.0f;
+        float sr = -1.0f;
+        int tweaks_mode = -1;
+        int num_partials = -1;
+        int tuning_mode = -1;
+        int edo = -1;
+        uint64_t ratios_serial = ~0ULL;
+        bool operator==(const PartialFreqInputs &) const = default;
+    };
+    struct ShapingFilterInputs
+    {
+        float morph = -1.0f;
+        int mode = -1;
+        bool operator==(const ShapingFilterInputs &) const = default;
+    };
+    PartialFreqInputs m_last_freq_inputs;
+    ShapingFilterInputs m_last_filter_inputs;
     float m_fundamental_freq = 1.0;
 
     float m_sr = 44100.0;
@@ -356,7 +819,9 @@ class AdditiveVoice
     float m_pan = 0.5f; // center
     float m_partials_pan_morph = 0.5;
 
-    std::optional<SimpleLFO> surge_lfo[4];
+    int m_slot = 0;
+    bool m_amp_env_finished = false;
+    void updateEnvelopeParameters();
 
     int state_update_counter = 0;
 };
@@ -365,16 +830,44 @@ class AdditiveSynth
 {
   public:
     AdditiveSynth();
-    void prepare(double sampleRate, int maxbufsize);
+    static constexpr int maxpolyphony = 64;
+    static_assert(maxpolyphony <= LFOBank::maxvoices);
+    static_assert(maxpolyphony <= AdditiveSharedData::VoiceEnvelopeBank::numlanes);
+    static constexpr int defaultpolyphony = 16;
+    // (re)allocates the voice pool, so polyphony can only be changed here
+    void prepare(double sampleRate, int maxbufsize, int polyphony = defaultpolyphony);
     void processBlock(choc::buffer::ChannelArrayView<float> destBuf);
     AdditiveSharedData m_shared_data;
 
-    alignas(32)
-        std::array<AdditiveVoice, 8> m_voices; // {constructFill<AdditiveVoice,8>(&m_shared_data)};
+    // view into the voice pool, all voices regardless of whether they are playing or not
+    std::span<AdditiveVoice> m_voices;
+    int getPolyphony() const { return (int)m_voices.size(); }
 
-    // juce::String importScalaFile(juce::File file);
-    // juce::String importKBMFile(juce::File file);
-    // juce::String importKBMText(juce::String text);
+    // a Scala scale or a keyboard mapping, from a file or from text. an empty source keeps that
+    // part of the current tuning
+    struct TuningSource
+    {
+        std::filesystem::path file;
+        std::string text;
+        bool empty() const { return file.empty() && text.empty(); }
+    };
+    // any thread. the files are read and parsed and the key tables are built and validated on a
+    // worker thread, then handed over to the audio thread in one step. imports requested before
+    // the worker gets to them are merged, the latest scale and mapping win. errors are reported
+    // with getTuningImportError
+    void importTuningAsync(TuningSource scl, TuningSource kbm);
+    void importScalaFileAsync(std::filesystem::path path) { importTuningAsync({path, {}}, {}); }
+    void importKBMFileAsync(std::filesystem::path path) { importTuningAsync({}, {path, {}}); }
+    void importScalaTextAsync(std::string text) { importTuningAsync({{}, text}, {}); }
+    void importKBMTextAsync(std::string text) { importTuningAsync({}, {{}, text}); }
+    // the error of the latest finished import, empty if it succeeded
+    std::string getTuningImportError()
+    {
+        std::lock_guard<std::mutex> locker(m_tuning_import_mutex);
+        return m_tuning_import_error;
+    }
+    // increases when an import has finished, successfully or not
+    uint64_t getNumFinishedTuningImports() const { return m_num_finished_tuning_imports; }
     void setEDOParameters(double pseudoOctaveCents, int edo);
 
     double m_tuning_update_elapsed_ms = 0.0;
@@ -386,28 +879,165 @@ class AdditiveSynth
     int getEDO() { return m_edo; }
     void setModulationDepth(int source, int target, float amount)
     {
-        m_shared_data.modmatrix[source][target] = amount;
+        m_shared_data.setModulationDepth(source, target, amount);
     }
     std::atomic<int> m_num_active_voices{0};
+    // loads a binary morph table file on a worker thread, the table is taken into use by the
+    // audio thread when ready. errors are reported with getMorphTableLoadError
+    void loadMorphTableAsync(std::filesystem::path path);
+    // blocks until the requested morph table loads, tuning imports and state restores are done,
+    // for offline use and testing
+    void waitForBackgroundTasks() { m_worker.waitUntilIdle(); }
+    std::string getMorphTableLoadError()
+    {
+        std::lock_guard<std::mutex> locker(m_morph_table_error_mutex);
+        return m_morph_table_load_error;
+    }
+    // the state besides the parameters, for the plugin state saving
+    struct PersistentState
+    {
+        std::string scl;
+        std::string kbm;
+        // the modulation depths source after source
+        std::vector<float> moddepths;
+        // the loaded morph table in the morph table file format, empty if none was loaded
+        std::string morphtable;
+    };
+    // non-audio thread. waits for the requested restores, imports and loads to finish first,
+    // so that the result is never older than what was requested
+    PersistentState getPersistentState();
+    // non-audio thread. the mod matrix is taken into use directly, the tuning is imported like
+    // with importTuningAsync and the morph table is decoded like with loadMorphTableAsync,
+    // with the errors reported the same way
+    void restorePersistentStateAsync(PersistentState state);
+    // the source is polled once per control block while processing, so this should only be
+    // set when the audio isn't running. nullptr uses only the internal tuning
+    void setKeyTuningSource(KeyTuningSource *source)
+    {
+        m_key_tuning_source = source;
+        if (!source)
+            m_shared_data.m_external_key_pitches.active = false;
+    }
+    // quality of the output saturation stage, 0 : no oversampling, 1 : 2x oversampled,
+    // 2 : 4x oversampled. can be set from any thread, applied at the start of the next block
+    void setSaturatorQuality(int q) { m_saturator_quality = std::clamp(q, 0, 2); }
+    int getSaturatorQuality() const { return m_saturator_quality; }
     void handleNoteOn(int port_index, int channel, int key, int noteid, double velo);
     void handleNoteOff(int port_index, int channel, int key, int noteid);
     void handleCC(int port_index, int channel, int cc, int value);
     void handlePitchBend(int port_index, int channel, float value);
     void handlePolyAfterTouch(int port_index, int channel, int note, float value);
+    enum class ParamIDs
+    {
+        FilterMorph,
+        Pan,
+        Volume,
+        NumPartials,
+        PartialsBalance,
+        PartialsPanMorph,
+        FilterMode,
+        PseudoOctave,
+        PartialTuningMode,
+        PartialEDO,
+        FreqTweaksMode,
+        FreqTweaksMix,
+        VelocityResponse,
+        EG0Attack,
+        EG0Decay,
+        EG0Sustain,
+        EG0Release,
+        EG1Attack,
+        EG1Decay,
+        EG1Sustain,
+        EG1Release,
+        LFO0Rate,
+        LFO1Rate,
+        LFO2Rate,
+        LFO3Rate,
+        LFO0Shape,
+        LFO1Shape,
+        LFO2Shape,
+        LFO3Shape,
+        LFO0Deform,
+        LFO1Deform,
+        LFO2Deform,
+        LFO3Deform,
+        PitchAdjust,
+        PitchBendRange,
+        VolumeMorphPreset,
+        PanMorphPreset,
+        SaturatorQuality,
+        PartialCullThreshold,
+        PitchModQuantize,
+        PartialEnvMode,
+        PartialEnvAttack,
+        PartialEnvDecay,
+        PartialEnvSustain,
+        PartialEnvRelease,
+        PartialEnvTilt,
+        UnisonCount,
+        UnisonDetune,
+        UnisonSpread,
+        NoiseBandwidth,
+        NoiseBandwidthTilt,
+        NoiseFilterCutoff,
+        BurstMix,
+        BurstDuration,
+        BurstCount,
+        BurstProbability,
+        BurstDistribution,
+        VoiceSilenceThreshold,
+        NumParams
+    };
+    // values with a note id, or key and channel, only go to the voice playing that note
     void handleParameterValue(int port_index, int channel, int key, int note_id, clap_id parid,
                               double value);
+    void handleParameterModulation(int port_index, int channel, int key, int note_id,
+                                   clap_id parid, double amount);
 
   private:
+    std::unique_ptr<AdditiveVoice[]> m_voice_pool;
+    // dense lists of voices, so that rendering only visits the playing voices.
+    // both are reserved to the polyphony in prepare, so these never allocate when
+    // voices are started or freed
+    std::vector<AdditiveVoice *> m_active_voices;
+    std::vector<AdditiveVoice *> m_free_voices;
+    void reclaimFinishedVoices();
+    // O(1) lookups of the voices by CLAP note id
+    NoteIdVoiceMap<AdditiveVoice, 2 * maxpolyphony> m_note_id_voices;
+    void unindexVoice(AdditiveVoice *v);
+    // calls func for all the active voices of the key, channel -1 matches all channels. a key
+    // can have several voices, since repeated notes can start before the earlier ones end
+    template <typename F> void forEachVoiceOfKey(int channel, int key, F &&func);
+    AdditiveVoice *findVoiceToSteal();
+    // calls func for the voices an event with the note id, key etc applies to
+    template <typename F> void forEachTargetVoice(int port, int ch, int key, int note_id, F &&func);
+    void applyVoiceParameter(AdditiveVoice &v, ParamIDs parid, double value);
+    static float AdditiveVoice::ParamModulation::*getModulationField(ParamIDs parid);
     choc::buffer::ChannelArrayBuffer<float> m_mixbuf;
+    std::atomic<int> m_saturator_quality{0};
+    OversampledSaturator m_saturators[2];
+    // also guards the loaded morph table data
+    std::mutex m_morph_table_error_mutex;
+    std::string m_morph_table_load_error;
+    std::string m_morph_table_data;
+    MorphTableLoader m_morph_table_loader;
+    void runTuningImport();
+    std::mutex m_tuning_import_mutex;
+    TuningSource m_pending_scl;
+    TuningSource m_pending_kbm;
+    std::string m_tuning_import_error;
+    std::atomic<uint64_t> m_num_finished_tuning_imports{0};
+    // the morph table loads, tuning imports and state restores, in the order they were
+    // requested. declared after everything its tasks use, so stopped before those are destroyed
+    TaskWorker m_worker;
     int m_note_counter = 0;
-    int m_time_pos_counter = 0;
-    int m_kbm_start_note = -1;
-    int m_kbm_ref_note = -1;
-    double m_kbm_freq = -1;
+    int64_t m_time_pos_counter = 0;
+    KeyTuningSource *m_key_tuning_source = nullptr;
+    int64_t m_key_tuning_poll_pos = 0;
     double m_pseudo_octave = 1200.0;
     int m_edo = 0;
     bool m_sustain_pedal = false;
     double m_pitch_bend_range = 1.0;
     double m_cur_pitch_bend = 0.0;
-    std::mutex m_cs;
 };
@@ -0,0 +1,93 @@
+#pragma once
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include "containers/choc_SingleReaderSingleWriterFIFO.h"
+
+/*
+Hands immutable objects built on a non-realtime thread over to the audio thread without locking
+the audio thread. The publishing side builds a complete new object and publishes it, the audio
+thread picks up the latest published object with a single atomic exchange when it calls update(),
+typically at the start of its processing block. Objects the audio thread has stopped using are
+passed back via a FIFO and deleted on the publishing side, so the audio thread never allocates,
+frees or waits for anything.
+
+If several objects are published before the audio thread has picked any of them up, only the
+latest one is ever used and the skipped ones are deleted directly by the publisher.
+
+The mutex only serializes publishers (there may be several non-realtime threads publishing),
+the audio thread never touches it.
+*/
+template <typename T> class SnapshotExchange
+{
+  public:
+    SnapshotExchange(uint32_t retireCapacity = 64) : m_retire_capacity(retireCapacity)
+    {
+        m_retired.reset(retireCapacity);
+    }
+    ~SnapshotExchange()
+    {
+        collectGarbage();
+        delete m_pending.exchange(nullptr);
+        // at destruction time the audio thread can't be using this anymore
+        delete m_current;
+    }
+    SnapshotExchange(const SnapshotExchange &) = delete;
+    SnapshotExchange &operator=(const SnapshotExchange &) = delete;
+    // Only to be used when the audio thread is known not to be running, for example
+    // in constructors or before processing has been started
+    void setImmediately(std::unique_ptr<T> snapshot)
+    {
+        std::lock_guard<std::mutex> locker(m_publish_mutex);
+        delete m_pending.exchange(nullptr);
+        delete m_current;
+        m_current = snapshot.release();
+    }
+    // non-realtime threads
+    void publish(std::unique_ptr<T> snapshot)
+    {
+        std::lock_guard<std::mutex> locker(m_publish_mutex);
+        collectGarbageImpl();
+        T *skipped = m_pending.exchange(snapshot.release(), std::memory_order_acq_rel);
+        // never seen by the audio thread, so it's safe to get rid of here
+        delete skipped;
+    }
+    // non-realtime threads
+    void collectGarbage()
+    {
+        std::lock_guard<std::mutex> locker(m_publish_mutex);
+        collectGarbageImpl();
+    }
+    // audio thread, returns true if a new object was taken into use
+    bool update() noexcept
+    {
+        // we are the only pusher into the retire FIFO, so if there's space now, there will be
+        // space after the exchange too. if there isn't, just keep using the current object until
+        // the publisher has drained the FIFO
+        if (m_retired.getUsedSlots() >= m_retire_capacity)
+            return false;
+        T *fresh = m_pending.exchange(nullptr, std::memory_order_acq_rel);
+        if (!fresh)
+            return false;
+        if (m_current)
+            m_retired.push(m_current);
+        m_current = fresh;
+        return true;
+    }
+    // audio thread, the pointer is valid until the next call to update()
+    const T *get() const noexcept { return m_current; }
+
+  private:
+    void collectGarbageImpl()
+    {
+        T *retired = nullptr;
+        while (m_retired.pop(retired))
+            delete retired;
+    }
+    std::atomic<T *> m_pending{nullptr};
+    T *m_current = nullptr;
+    choc::fifo::SingleReaderSingleWriterFIFO<T *> m_retired;
+    uint32_t m_retire_capacity = 0;
+    std::mutex m_publish_mutex;
+};
@@ -0,0 +1,81 @@
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+
+/*
+Runs tasks on a worker thread, in the order they were posted, for rebuilding data that is too
+heavy to build on the audio thread or to block the main thread with. The worker is started on
+the first post.
+
+Jobs where only the latest request matters keep their pending request in a member and post a
+task that takes it, so when requests come faster than they can be done, the tasks that find
+nothing pending return right away. See AdditiveSynth::importTuningAsync.
+*/
+class TaskWorker
+{
+  public:
+    using Task = std::function<void()>;
+    TaskWorker() {}
+    ~TaskWorker()
+    {
+        {
+            std::lock_guard<std::mutex> locker(m_mutex);
+            m_quit = true;
+        }
+        m_cv.notify_all();
+        if (m_thread.joinable())
+            m_thread.join();
+    }
+    TaskWorker(const TaskWorker &) = delete;
+    TaskWorker &operator=(const TaskWorker &) = delete;
+    void post(Task task)
+    {
+        {
+            std::lock_guard<std::mutex> locker(m_mutex);
+            m_tasks.push_back(std::move(task));
+            if (!m_thread.joinable())
+                m_thread = std::thread([this] { run(); });
+        }
+        m_cv.notify_all();
+    }
+    // blocks until all the posted tasks have finished
+    void waitUntilIdle()
+    {
+        std::unique_lock<std::mutex> locker(m_mutex);
+        m_cv.wait(locker, [this] { return m_tasks.empty() && !m_running; });
+    }
+
+  private:
+    void run()
+    {
+        while (true)
+        {
+            Task task;
+            {
+                std::unique_lock<std::mutex> locker(m_mutex);
+                m_cv.wait(locker, [this] { return m_quit || !m_tasks.empty(); });
+                if (m_quit)
+                    return;
+                task = std::move(m_tasks.front());
+                m_tasks.pop_front();
+                m_running = true;
+            }
+            task();
+            {
+                std::lock_guard<std::mutex> locker(m_mutex);
+                m_running = false;
+            }
+            m_cv.notify_all();
+        }
+    }
+    std::mutex m_mutex;
+    std::condition_variable m_cv;
+    std::deque<Task> m_tasks;
+    bool m_running = false;
+    bool m_quit = false;
+    std::thread m_thread;
+};
@@ -0,0 +1,53 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+
+/*
+Passes the latest version of a value from one writer thread to one reader thread, without
+either of them ever waiting. The writer fills the back buffer and publishes it by swapping it
+with the middle buffer, the reader takes the middle buffer into use by swapping it with its front
+buffer, if something new has been published since. Both swaps are single atomic exchanges.
+
+Versions published while the reader isn't looking are simply overwritten, so this is for things
+like visualization data where only the latest state matters.
+*/
+template <typename T> class TripleBuffer
+{
+  public:
+    TripleBuffer() = default;
+    TripleBuffer(const TripleBuffer &) = delete;
+    TripleBuffer &operator=(const TripleBuffer &) = delete;
+    // writer thread, the buffer to fill before calling publish
+    T &getWriteBuffer() noexcept { return m_buffers[m_back]; }
+    // writer thread
+    void publish() noexcept
+    {
+        uint32_t old = m_middle.exchange(m_back | dirtyflag, std::memory_order_acq_rel);
+        m_back = old & indexmask;
+    }
+    // reader thread, takes the most recently published buffer into use if there is one and
+    // returns true if it did
+    bool update() noexcept
+    {
+        if ((m_middle.load(std::memory_order_relaxed) & dirtyflag) == 0)
+            return false;
+        uint32_t old = m_middle.exchange(m_front, std::memory_order_acq_rel);
+        m_front = old & indexmask;
+        return true;
+    }
+    // reader thread, valid until the next call to update
+    const T &getReadBuffer() const noexcept { return m_buffers[m_front]; }
+
+  private:
+    static constexpr uint32_t dirtyflag = 4;
+    static constexpr uint32_t indexmask = 3;
+    std::array<T, 3> m_buffers{};
+    // only touched by the writer
+    uint32_t m_back = 0;
+    // index of the middle buffer, with the dirty flag set if the reader hasn't taken it yet
+    std::atomic<uint32_t> m_middle{1};
+    // only touched by the reader
+    uint32_t m_front = 2;
+};
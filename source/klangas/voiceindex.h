@@ -0,0 +1,100 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+
+/*
+Maps CLAP note ids to voices with open addressing and linear probing. The capacity is fixed,
+so nothing is allocated when notes start and end on the audio thread. Each voice has at most
+one note id, so keeping Capacity at least twice the polyphony keeps the probe sequences short.
+*/
+template <typename Voice, int Capacity> class NoteIdVoiceMap
+{
+  public:
+    static_assert((Capacity & (Capacity - 1)) == 0, "capacity must be a power of 2");
+    NoteIdVoiceMap() { clear(); }
+    void clear() { m_entries.fill(Entry{}); }
+    // negative note ids mean the note doesn't have an id, those are ignored
+    void insert(int32_t noteid, Voice *v)
+    {
+        if (noteid < 0)
+            return;
+        int i = slotFor(noteid);
+        for (int n = 0; n < Capacity; ++n)
+        {
+            auto &e = m_entries[i];
+            if (e.noteid == noteid || e.noteid < 0)
+            {
+                e.noteid = noteid;
+                e.voice = v;
+                return;
+            }
+            i = (i + 1) & (Capacity - 1);
+        }
+    }
+    Voice *find(int32_t noteid) const
+    {
+        if (noteid < 0)
+            return nullptr;
+        int i = slotFor(noteid);
+        for (int n = 0; n < Capacity; ++n)
+        {
+            const auto &e = m_entries[i];
+            if (e.noteid == noteid)
+                return e.voice;
+            if (e.noteid < 0)
+                return nullptr;
+            i = (i + 1) & (Capacity - 1);
+        }
+        return nullptr;
+    }
+    // removes the entry only if it still belongs to the voice
+    void erase(int32_t noteid, const Voice *v)
+    {
+        if (noteid < 0)
+            return;
+        int i = slotFor(noteid);
+        for (int n = 0; n < Capacity; ++n)
+        {
+            if (m_entries[i].noteid < 0)
+                return;
+            if (m_entries[i].noteid == noteid)
+            {
+                if (m_entries[i].voice == v)
+                    removeAt(i);
+                return;
+            }
+            i = (i + 1) & (Capacity - 1);
+        }
+    }
+
+  private:
+    struct Entry
+    {
+        int32_t noteid = -1;
+        Voice *voice = nullptr;
+    };
+    static int slotFor(int32_t noteid) { return ((uint32_t)noteid * 2654435761u) & (Capacity - 1); }
+    // backward shift deletion, moves the following entries of the probe sequence back so
+    // lookups don't need tombstones
+    void removeAt(int i)
+    {
+        int j = i;
+        while (true)
+        {
+            j = (j + 1) & (Capacity - 1);
+            if (m_entries[j].noteid < 0)
+                break;
+            int home = slotFor(m_entries[j].noteid);
+            // the entry at j can fill the hole at i if its home slot isn't cyclically in (i, j]
+            bool movable = i <= j ? (home <= i || home > j) : (home <= i && home > j);
+            if (movable)
+            {
+                m_entries[i] = m_entries[j];
+                i = j;
+            }
+        }
+        m_entries[i] = Entry{};
+    }
+    std::array<Entry, Capacity> m_entries;
+};
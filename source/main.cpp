@@ -1,65 +1,110 @@
 #include <iostream>
 #include <memory>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <random>
 #include "klangas/sineosc.h"
 #include "audio/choc_AudioFileFormat_WAV.h"
 #include "noiseplethora/noiseplethoraengine.h"
 
-inline void test_klangas()
-{
-    double sr = 44100.0;
-    unsigned int bufsize = 441;
-    choc::audio::AudioFileProperties props;
-    props.bitDepth = choc::audio::BitDepth::float32;
-    props.numChannels = 2;
-    props.formatName = "WAV";
-    props.sampleRate = sr;
-    choc::audio::WAVAudioFileFormat<true> wavformat;
-    auto writer = wavformat.createWriter("C:/develop/xen_clap_plugins/klangasnew02.wav", props);
-    choc::buffer::ChannelArrayBuffer<float> procbuf{2, bufsize};
-    procbuf.clear();
-    auto as = std::make_unique<AdditiveSynth>();
-
-    as->prepare(sr, bufsize);
+/*
+Offline scaling benchmark of the KlangAS engine, nothing is written to disk. Sweeps the number of
+voices, the number of partials (beyond 64 with the unison copies), the processing block size and
+the modulation load, and writes one CSV row per configuration. The notes are held at full level
+and the partial culling is set to the minimum, so every oscillator is rendered all the time.
 
-    as->handleNoteOn(0, 0, 40, -1, 1.0);
-    int outlen = 10 * sr;
-    int outcount = 0;
-    as->m_shared_data.setVolumeMorphPreset(1);
-    as->m_shared_data.setPanMorphPreset(0);
-    xenakios::Envelope<64> tweaksEnv;
-    tweaksEnv.addPoint({0.0, 0.0});
-    tweaksEnv.addPoint({5.0, 1.0});
-    tweaksEnv.addPoint({5.1, 0.0});
-    tweaksEnv.addPoint({10.0, 0.5});
-    xenakios::Envelope<64> filterEnv;
-    filterEnv.addPoint({0.0, 1.0});
-    filterEnv.addPoint({5.0, 0.2});
-    filterEnv.addPoint({10.0, 1.0});
-
-    while (outcount < outlen)
+ns_per_osc_sample is the time per output sample divided by the number of oscillators playing
+(voices x partials x unison copies), realtime_factor is the rendered audio duration divided by
+the processing time.
+*/
+inline void bench_klangas_scaling(std::ostream &os, double seconds = 2.0)
+{
+    using PID = AdditiveSynth::ParamIDs;
+    using SD = AdditiveSharedData;
+    const double sr = 44100.0;
+    const double warmupseconds = 0.25;
+    struct PartialsConfig
     {
-        double secpos = outcount / sr;
-        double tweaksVal = tweaksEnv.getValueAtPosition(secpos, sr);
-        double filterVal = filterEnv.getValueAtPosition(secpos, sr);
-        for (auto &v : as->m_voices)
+        int partials;
+        int unison;
+    };
+    const int voicecounts[] = {1, 4, 16, 64};
+    const PartialsConfig partialconfigs[] = {{2, 1}, {8, 1}, {32, 1}, {64, 1}, {64, 2}, {64, 4}};
+    const int blocksizes[] = {32, 128, 512};
+    const char *modloadnames[] = {"none", "light", "heavy"};
+    os << "voices,partials,unison,oscillators,blocksize,modload,active_voices,ns_per_sample,"
+          "ns_per_osc_sample,realtime_factor,peak\n";
+    for (int modload = 0; modload < 3; ++modload)
+    {
+        for (int blocksize : blocksizes)
         {
-            v.setNumPartials(32);
-            v.setADSRParameters(0, 0.2, 0.6, 0.5, 0.2);
-            v.setADSRParameters(1, 0.2, 0.2, 0.5, 0.2);
-            v.m_freq_tweaks_mode = 4;
-            v.m_freq_tweaks_mix = tweaksVal;
-            v.m_adsr_burst_mix = 0.0;
-            v.m_base_volume = -9.0;
-            v.m_filter_morph = filterVal;
-            v.m_filter_mode = 2;
-            v.setPartialsBalance(1.0);
-            v.setPartialsPanMorph(0.0);
+            for (int numvoices : voicecounts)
+            {
+                for (auto pc : partialconfigs)
+                {
+                    auto as = std::make_unique<AdditiveSynth>();
+                    as->prepare(sr, blocksize, numvoices);
+                    auto setpar = [&as](PID id, double v) {
+                        as->handleParameterValue(-1, -1, -1, -1, (clap_id)id, v);
+                    };
+                    setpar(PID::NumPartials, pc.partials);
+                    setpar(PID::UnisonCount, pc.unison);
+                    setpar(PID::PartialCullThreshold, -160.0);
+                    setpar(PID::EG0Sustain, 1.0);
+                    if (modload >= 1)
+                    {
+                        as->setModulationDepth(SD::MOS_LFO0, SD::MOT_PITCH, 0.1f);
+                        as->setModulationDepth(SD::MOS_EG1, SD::MOT_FILTERMORPH, 0.5f);
+                    }
+                    if (modload == 2)
+                    {
+                        // everything modulates everything, with differing LFO rates and shapes
+                        for (int i = 0; i < 4; ++i)
+                        {
+                            setpar((PID)((int)PID::LFO0Rate + i), -1.0 + i);
+                            setpar((PID)((int)PID::LFO0Shape + i), i);
+                        }
+                        for (int i = 0; i < SD::MOS_LAST; ++i)
+                            for (int j = 0; j < SD::MOT_LAST; ++j)
+                                as->setModulationDepth(i, j, 0.05f);
+                    }
+                    for (int i = 0; i < numvoices; ++i)
+                        as->handleNoteOn(0, 0, 30 + i, -1, 1.0);
+                    choc::buffer::ChannelArrayBuffer<float> procbuf{2, (unsigned int)blocksize};
+                    auto render = [&](double len) {
+                        float peak = 0.0f;
+                        int numblocks = (int)std::ceil(len * sr / blocksize);
+                        for (int i = 0; i < numblocks; ++i)
+                        {
+                            procbuf.clear();
+                            as->processBlock(procbuf.getView());
+                            for (uint32_t ch = 0; ch < 2; ++ch)
+                                for (int j = 0; j < blocksize; ++j)
+                                    peak = std::max(peak, std::abs(procbuf.getSample(ch, j)));
+                        }
+                        return std::make_pair(numblocks * blocksize, peak);
+                    };
+                    // lets the attacks and the parameter smoothings settle
+                    render(warmupseconds);
+                    int activevoices = as->m_num_active_voices;
+                    auto t0 = std::chrono::steady_clock::now();
+                    auto [numsamples, peak] = render(seconds);
+                    auto t1 = std::chrono::steady_clock::now();
+                    double ns = std::chrono::duration<double, std::nano>(t1 - t0).count();
+                    int numoscs = numvoices * pc.partials * pc.unison;
+                    double nspersample = ns / numsamples;
+                    os << numvoices << "," << pc.partials << "," << pc.unison << "," << numoscs
+                       << "," << blocksize << "," << modloadnames[modload] << "," << activevoices
+                       << "," << nspersample << "," << nspersample / numoscs << ","
+                       << (numsamples / sr) / (ns * 1e-9) << "," << peak << std::endl;
+                }
+            }
         }
-
-        as->processBlock(procbuf.getView());
-        choc::buffer::applyGain(procbuf, 0.9);
-        writer->appendFrames(procbuf.getView());
-        outcount += bufsize;
     }
 }
 
@@ -98,9 +143,223 @@ inline void test_noise_plethora_monomode()
     }
 }
 
-int main()
+// compares the output saturation stage options of KlangAS against the plain std::tanh loop
+inline void bench_saturator()
+{
+    const int bufsize = 256;
+    const int numbufs = 20000;
+    std::minstd_rand rng(42);
+    std::uniform_real_distribution<float> dist(-4.0f, 4.0f);
+    std::vector<float> input(bufsize * 16);
+    for (auto &e : input)
+        e = dist(rng);
+    std::vector<float> buf(bufsize);
+    auto run = [&](const char *name, auto &&func) {
+        double checksum = 0.0;
+        auto t0 = std::chrono::high_resolution_clock::now();
+        for (int i = 0; i < numbufs; ++i)
+        {
+            std::copy(input.begin() + (i % 16) * bufsize, input.begin() + (i % 16 + 1) * bufsize,
+                      buf.begin());
+            func(buf.data(), bufsize);
+            checksum += buf[i % bufsize];
+        }
+        auto t1 = std::chrono::high_resolution_clock::now();
+        double ns = std::chrono::duration<double, std::nano>(t1 - t0).count();
+        std::cout << name << " : " << ns / ((double)numbufs * bufsize) << " ns/sample (checksum "
+                  << checksum << ")\n";
+    };
+    run("std::tanh", [](float *data, int n) {
+        for (int i = 0; i < n; ++i)
+            data[i] = std::tanh(data[i]);
+    });
+    run("SIMD rational tanh", [](float *data, int n) { xenakios::fasttanh_block(data, n); });
+    for (int factor : {2, 4})
+    {
+        OversampledSaturator sat;
+        sat.prepare(bufsize);
+        sat.setOversampling(factor);
+        auto name = std::to_string(factor) + "x oversampled SIMD rational tanh";
+        run(name.c_str(), [&sat](float *data, int n) { sat.process(data, n); });
+    }
+}
+
+// measures how long creating KlangAS engine instances takes. the first instance also generates
+// the process wide shared tables, so it's reported separately
+inline void bench_klangas_startup()
+{
+    const int numinstances = 50;
+    std::vector<std::unique_ptr<AdditiveSynth>> instances;
+    using clock = std::chrono::high_resolution_clock;
+    auto t0 = clock::now();
+    instances.push_back(std::make_unique<AdditiveSynth>());
+    auto t1 = clock::now();
+    for (int i = 1; i < numinstances; ++i)
+        instances.push_back(std::make_unique<AdditiveSynth>());
+    auto t2 = clock::now();
+    for (auto &as : instances)
+        as->prepare(44100.0, 512);
+    auto t3 = clock::now();
+    auto ms = [](auto d) { return std::chrono::duration<double, std::milli>(d).count(); };
+    std::cout << "first KlangAS instance : " << ms(t1 - t0) << " ms\n";
+    std::cout << "further instances : " << ms(t2 - t1) / (numinstances - 1) << " ms each\n";
+    std::cout << "prepare : " << ms(t3 - t2) / numinstances << " ms each\n";
+    std::cout << numinstances << " instances total : " << ms(t3 - t0) << " ms\n";
+}
+
+// prints the result of a test check, returns 1 if it failed so that the failures can be summed
+inline int check(bool ok, const char *what)
+{
+    std::cout << (ok ? "PASS " : "FAIL ") << what << "\n";
+    return ok ? 0 : 1;
+}
+
+// checks the morph table loading on the KlangAS worker thread : the error for a missing file,
+// that the latest of several requests ends up in use, that the audio thread takes the table
+// into use and that restoring a state without a table unloads it. returns the number of failed
+// checks
+inline int test_klangas_morph_table_loading()
+{
+    int failures = 0;
+    auto as = std::make_unique<AdditiveSynth>();
+    as->prepare(44100.0, 256);
+    choc::buffer::ChannelArrayBuffer<float> procbuf{2, 256};
+    auto tempdir = std::filesystem::temp_directory_path();
+
+    as->loadMorphTableAsync(tempdir / "klangas_no_such_table.klmt");
+    as->waitForBackgroundTasks();
+    failures += check(as->getMorphTableLoadError().find("Could not open") == 0,
+                      "missing morph table file reports an error");
+
+    std::string error;
+    for (int numframes : {2, 5})
+    {
+        CompactMorphTable table(numframes, 16);
+        table.setGain(numframes - 1, 0, 1.0f);
+        table.updateGuardFrame();
+        auto path = tempdir / ("klangas_test_table" + std::to_string(numframes) + ".klmt");
+        writeMorphTableFile(path, table, error);
+    }
+    as->loadMorphTableAsync(tempdir / "klangas_test_table2.klmt");
+    as->loadMorphTableAsync(tempdir / "klangas_test_table5.klmt");
+    as->waitForBackgroundTasks();
+    failures += check(as->getMorphTableLoadError().empty(),
+                      "morph table file loads without errors");
+    as->processBlock(procbuf.getView());
+    auto table = as->m_shared_data.getLoadedMorphTable();
+    failures += check(table && table->getNumFrames() == 5,
+                      "latest requested morph table is in use");
+
+    // the data saved in the state is the loaded table
+    std::istringstream is(as->getPersistentState().morphtable);
+    auto saved = readMorphTable(is, "saved table", error);
+    failures += check(saved && saved->getNumFrames() == 5 && saved->getGain(4, 0) == 1.0f,
+                      "loaded morph table is saved in the state");
+
+    // restoring a state without a table takes the loaded one out of use
+    auto state = as->getPersistentState();
+    state.morphtable.clear();
+    as->restorePersistentStateAsync(std::move(state));
+    as->waitForBackgroundTasks();
+    as->processBlock(procbuf.getView());
+    failures += check(as->m_shared_data.getLoadedMorphTable() == nullptr &&
+                          as->getPersistentState().morphtable.empty(),
+                      "state without a morph table unloads the loaded table");
+    return failures;
+}
+
+// checks the tuning import on the KlangAS worker thread : the errors for a missing file, for
+// text that isn't a scale and for an unusable scale, that a scale and a mapping imported right
+// after each other are both applied, and that the audio thread takes the tuning into use.
+// returns the number of failed checks
+inline int test_klangas_tuning_import()
 {
+    int failures = 0;
+    auto edoscale = [](int edo) {
+        std::string text = "! " + std::to_string(edo) + "edo.scl\n" + std::to_string(edo) +
+                           " equal\n" + std::to_string(edo) + "\n!\n";
+        for (int i = 1; i <= edo; ++i)
+            text += std::to_string(1200.0 * i / edo) + "\n";
+        return text;
+    };
+    // linear mapping with A at 432 Hz
+    const std::string kbm = "! a432.kbm\n0\n0\n127\n60\n69\n432.0\n0\n";
+    auto as = std::make_unique<AdditiveSynth>();
+    as->prepare(44100.0, 256);
+    choc::buffer::ChannelArrayBuffer<float> procbuf{2, 256};
+    auto tuningafterblock = [&]() -> const TuningSnapshot & {
+        as->waitForBackgroundTasks();
+        as->processBlock(procbuf.getView());
+        return as->m_shared_data.getTuning();
+    };
+
+    as->importScalaFileAsync(std::filesystem::temp_directory_path() / "klangas_no_such.scl");
+    as->waitForBackgroundTasks();
+    failures += check(as->getTuningImportError().find("Could not import") == 0,
+                      "missing Scala file reports an error");
+
+    // the 12 EDO scale is replaced by the 19 EDO one before or after it is built
+    as->importScalaTextAsync(edoscale(12));
+    as->importScalaTextAsync(edoscale(19));
+    as->importKBMTextAsync(kbm);
+    const auto &tuning = tuningafterblock();
+    failures += check(as->getTuningImportError().empty(), "valid tuning imports without errors");
+    failures += check(tuning.tuning.scale.count == 19, "latest imported scale is in use");
+    float a432 = 12.0f * std::log2(432.0f / Tunings::MIDI_0_FREQ);
+    failures += check(std::abs(tuning.pitchForKey(69.0f) - a432) < 0.01f,
+                      "imported mapping is in use with the scale");
+    failures += check(std::abs(tuning.pitchForKey(88.0f) - (a432 + 12.0f)) < 0.01f,
+                      "19 EDO keys are tuned from the mapping");
+    auto serial = tuning.serial;
+
+    as->importScalaTextAsync("this is not a scale");
+    failures += check(tuningafterblock().serial == serial && !as->getTuningImportError().empty(),
+                      "invalid Scala text reports an error and keeps the tuning");
+    as->importScalaTextAsync("! zero.scl\nzero period\n1\n!\n0.0\n");
+    failures += check(tuningafterblock().serial == serial && !as->getTuningImportError().empty(),
+                      "scale with a zero period is rejected");
+    return failures;
+}
+
+// without arguments renders the noise plethora test. the KlangAS tests are run with the argument
+// klangas-tests, the benchmarks with their names : saturator, klangas-startup, or
+// klangas-scaling optionally followed by the CSV output file and the rendered seconds per
+// configuration
+int main(int argc, char **argv)
+{
+    std::string command = argc > 1 ? argv[1] : "";
+    if (command == "saturator")
+    {
+        bench_saturator();
+        return 0;
+    }
+    if (command == "klangas-tests")
+    {
+        int failures = test_klangas_morph_table_loading() + test_klangas_tuning_import();
+        return failures == 0 ? 0 : 1;
+    }
+    if (command == "klangas-startup")
+    {
+        bench_klangas_startup();
+        return 0;
+    }
+    if (command == "klangas-scaling")
+    {
+        double seconds = argc > 3 ? std::atof(argv[3]) : 2.0;
+        if (argc > 2 && std::string(argv[2]) != "-")
+        {
+            std::ofstream os(argv[2]);
+            if (!os)
+            {
+                std::cerr << "could not open " << argv[2] << "\n";
+                return 1;
+            }
+            bench_klangas_scaling(os, seconds);
+        }
+        else
+            bench_klangas_scaling(std::cout, seconds);
+        return 0;
+    }
     test_noise_plethora_monomode();
-    // test_klangas();
     std::cout << "finished\n";
 }
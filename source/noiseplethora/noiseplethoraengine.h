@@ -4,7 +4,6 @@
 #include "noise-plethora/plugins/Banks.hpp"
 #include "audio/choc_AudioFileFormat_WAV.h"
 #include "sst/basic-blocks/dsp/PanLaws.h"
-#include "sst/basic-blocks/modulators/ADSREnvelope.h"
 #include "sst/basic-blocks/dsp/FollowSlewAndSmooth.h"
 #include "gui/choc_DesktopWindow.h"
 #include "gui/choc_MessageLoop.h"
@@ -13,6 +12,8 @@
 #include "../xap_utils.h"
 #include "../xapdsp.h"
 #include "../common.h"
+#include "../envelopebank.h"
+#include <bit>
 // #define USE_SST_VM
 
 #ifdef USE_SST_VM
@@ -22,35 +23,8 @@
 
 constexpr size_t ENVBLOCKSIZE = 64;
 
-struct SRProviderB
-{
-    static constexpr int BLOCK_SIZE = ENVBLOCKSIZE;
-    static constexpr int BLOCK_SIZE_OS = BLOCK_SIZE * 2;
-    SRProviderB() { initTables(); }
-    alignas(32) float table_envrate_linear[512];
-    double samplerate = 44100.0;
-    void initTables()
-    {
-        double dsamplerate_os = samplerate * 2;
-        for (int i = 0; i < 512; ++i)
-        {
-            double k =
-                dsamplerate_os * pow(2.0, (((double)i - 256.0) / 16.0)) / (double)BLOCK_SIZE_OS;
-            table_envrate_linear[i] = (float)(1.f / k);
-        }
-    }
-    float envelope_rate_linear_nowrap(float x)
-    {
-        x *= 16.f;
-        x += 256.f;
-        int e = std::clamp<int>((int)x, 0, 0x1ff - 1);
-
-        float a = x - (float)e;
-
-        return (1 - a) * table_envrate_linear[e & 0x1ff] +
-               a * table_envrate_linear[(e + 1) & 0x1ff];
-    }
-};
+// the envelopes of all the voices are advanced together by the synth
+using VoiceEnvelopeBank = ADSREnvelopeBank<ENVBLOCKSIZE, 32>;
 
 // this was tested to work for this particular use case, but the more generic function
 // in utils should be checked/fixed too
@@ -87,9 +61,9 @@ class NoisePlethoraVoice
     float note_expr_pan = 0.0f;
     float keytrack_x_mod = 0.0f;
     float keytrack_y_mod = 0.0f;
-    using EnvType = sst::basic_blocks::modulators::ADSREnvelope<SRProviderB, ENVBLOCKSIZE>;
-    SRProviderB m_sr_provider;
-    EnvType m_vol_env{&m_sr_provider};
+    // the volume envelope is the voice's lane in the synth's envelope bank
+    VoiceEnvelopeBank *m_env_bank = nullptr;
+    int m_env_slot = 0;
 
     NoisePlethoraVoice()
     {
@@ -115,8 +89,6 @@ class NoisePlethoraVoice
     double hipasscutoff = 24.0;
     void prepare(double sampleRate)
     {
-        m_sr_provider.samplerate = sampleRate;
-        m_sr_provider.initTables();
         m_sr = sampleRate;
         dcblocker.setCoeff(hipasscutoff, 0.01, 1.0 / m_sr);
         dcblocker.init();
@@ -153,7 +125,8 @@ class NoisePlethoraVoice
         m_cur_plugin->init();
         m_voice_active = true;
         m_eg_gate = true;
-        m_vol_env.attackFrom(0.0f, 0.0f, 0, true);
+        m_env_bank->setParameters(m_env_slot, eg_attack, eg_decay, eg_sustain, eg_release);
+        m_env_bank->attack(m_env_slot);
         keytrack_x_mod = 0.0f;
         keytrack_y_mod = 0.0f;
         visualizationDirty = true;
@@ -191,8 +164,18 @@ class NoisePlethoraVoice
             keytrack_y_mod = xenakios::mapvalue<float>(iy, 0, gsize - 1, -0.5f, 0.5f);
         }
     }
-    void deactivate() { m_eg_gate = false; }
-    int m_update_counter = 0;
+    void deactivate()
+    {
+        m_eg_gate = false;
+        m_env_bank->setGate(m_env_slot, false);
+    }
+    // called by the synth when the volume envelope has ended
+    void envelopeFinished()
+    {
+        m_voice_active = false;
+        if (DeativatedVoiceCallback)
+            DeativatedVoiceCallback(port_id, chan, key, note_id);
+    }
     float eg_attack = 0.1f;
     float eg_decay = 0.5f;
     float eg_sustain = 0.75f;
@@ -205,9 +188,10 @@ class NoisePlethoraVoice
     float totaly = 0.0f;
     float total_gain = 0.0f;
     bool visualizationDirty = false;
-    // must accumulate into the buffer, precleared by the synth before processing the first voice
+    // must accumulate into the buffer, precleared by the synth before processing the first voice.
+    // envblockpos is the position of the buffer within the envelope control block
 
-    void process(choc::buffer::ChannelArrayView<float> destBuf)
+    void process(choc::buffer::ChannelArrayView<float> destBuf, int envblockpos)
     {
         if (!m_voice_active)
             return;
@@ -250,18 +234,11 @@ class NoisePlethoraVoice
             m_gain_slew.setLast(gain);
             m_pan_slew.setLast(totalpan);
         }
+        m_env_bank->setParameters(m_env_slot, eg_attack, eg_decay, eg_sustain, eg_release);
         auto chansdata = destBuf.data.channels;
         for (size_t i = 0; i < destBuf.size.numFrames; ++i)
         {
-            if (m_update_counter == 0)
-            {
-                m_vol_env.processBlock(eg_attack, eg_decay, eg_sustain, eg_release, 1, 1, 1,
-                                       m_eg_gate);
-            }
-            float envgain = m_vol_env.outputCache[m_update_counter];
-            ++m_update_counter;
-            if (m_update_counter == ENVBLOCKSIZE)
-                m_update_counter = 0;
+            float envgain = m_env_bank->getOutput(m_env_slot, envblockpos + i);
             auto smoothedgain = m_gain_slew.step(gain);
             auto smoothedpan = m_pan_slew.step(totalpan);
             // does expensive calculation, so might want to use tables or something instead
@@ -319,12 +296,6 @@ class NoisePlethoraVoice
             chansdata[0][i] += outL;
             chansdata[1][i] += outR;
         }
-        if (m_vol_env.stage == EnvType::s_eoc)
-        {
-            m_voice_active = false;
-            if (DeativatedVoiceCallback)
-                DeativatedVoiceCallback(port_id, chan, key, note_id);
-        }
     }
     int port_id = 0;
     int chan = 0;
@@ -347,6 +318,7 @@ class NoisePlethoraSynth
   public:
     using voice_t = NoisePlethoraVoice;
     static constexpr size_t maxVoiceCount = 32;
+    static_assert(maxVoiceCount <= VoiceEnvelopeBank::numlanes);
 #ifdef USE_SST_VM
     struct ConcreteMonoResp
     {
@@ -368,6 +340,8 @@ class NoisePlethoraSynth
         for (size_t i = 0; i < maxVoiceCount; ++i)
         {
             auto v = std::make_unique<NoisePlethoraVoice>();
+            v->m_env_bank = &m_env_bank;
+            v->m_env_slot = i;
             v->DeativatedVoiceCallback = [this](int port, int chan, int key, int noteid) {
                 deactivatedNotes.emplace_back(port, chan, key, noteid);
             };
@@ -386,8 +360,14 @@ class NoisePlethoraSynth
     {
         m_sr = sampleRate;
         m_mix_buf = choc::buffer::ChannelArrayBuffer<float>(2, (unsigned int)maxBlockSize);
+        m_env_bank.setSampleRate(sampleRate);
+        m_env_bank.reset();
+        m_env_block_pos = 0;
         for (auto &v : m_voices)
         {
+            // the envelopes were ended above, so the voices still playing end with them
+            if (v->m_voice_active)
+                v->envelopeFinished();
             v->prepare(sampleRate);
         }
     }
@@ -545,12 +525,34 @@ class NoisePlethoraSynth
         auto mixbufView =
             m_mix_buf.getSection(choc::buffer::ChannelRange{0, 2}, {0, destBuf.getNumFrames()});
         mixbufView.clear();
-        for (size_t i = 0; i < m_voices.size(); ++i)
+        // the voices are rendered in sections that end at the envelope control block boundaries,
+        // where the envelopes of all the voices are advanced together
+        const int nframes = destBuf.getNumFrames();
+        int pos = 0;
+        while (pos < nframes)
         {
-            if (m_voices[i]->m_voice_active)
+            if (m_env_block_pos == 0)
             {
-                m_voices[i]->process(mixbufView);
+                uint64_t finished = m_env_bank.process();
+                while (finished != 0)
+                {
+                    auto &v = m_voices[std::countr_zero(finished)];
+                    if (v->m_voice_active)
+                        v->envelopeFinished();
+                    finished &= finished - 1;
+                }
+            }
+            int len = std::min<int>(nframes - pos, ENVBLOCKSIZE - m_env_block_pos);
+            auto section = mixbufView.getFrameRange({(uint32_t)pos, (uint32_t)(pos + len)});
+            for (size_t i = 0; i < m_voices.size(); ++i)
+            {
+                if (m_voices[i]->m_voice_active)
+                {
+                    m_voices[i]->process(section, m_env_block_pos);
+                }
             }
+            m_env_block_pos = (m_env_block_pos + len) % ENVBLOCKSIZE;
+            pos += len;
         }
         choc::buffer::applyGain(mixbufView, 0.5);
         choc::buffer::copy(destBuf, mixbufView);
@@ -644,6 +646,8 @@ class NoisePlethoraSynth
 
   private:
     choc::buffer::ChannelArrayBuffer<float> m_mix_buf;
+    VoiceEnvelopeBank m_env_bank;
+    int m_env_block_pos = 0;
     double m_sr = 0;
     int m_update_counter = 0;
     int m_update_len = 32;